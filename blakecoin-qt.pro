@@ -192,6 +192,10 @@ HEADERS += src/qt/bitcoingui.h \
     src/uint256.h \
     src/serialize.h \
     src/main.h \
+    src/blockfile.h \
+    src/blockmap.h \
+    src/simd.h \
+    src/simdlanes.h \
     src/net.h \
     src/key.h \
     src/db.h \
@@ -323,7 +327,11 @@ SOURCES += src/qt/bitcoin.cpp \
     src/leveldb.cpp \
     src/txdb.cpp \
     src/qt/splashscreen.cpp \
-	src/blake.c 
+	src/blake.c \
+    src/blakescan.cpp \
+    src/merkle.cpp \
+    src/simd.cpp \
+    src/blockfile.cpp
 
 RESOURCES += src/qt/bitcoin.qrc
 
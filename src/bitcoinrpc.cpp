@@ -234,6 +234,7 @@ static const CRPCCommand vRPCCommands[] =
     { "addmultisigaddress",     &addmultisigaddress,     false,     false },
     { "createmultisig",         &createmultisig,         true,      true  },
     { "getrawmempool",          &getrawmempool,          true,      false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      false },
     { "getblock",               &getblock,               false,     false },
     { "getblockhash",           &getblockhash,           false,     false },
     { "gettransaction",         &gettransaction,         false,     false },
@@ -257,6 +258,10 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false },
+    { "getcoinscacheinfo",      &getcoinscacheinfo,      true,      false },
+    { "getvalidationinfo",      &getvalidationinfo,      true,      false },
+    { "getblockfilecacheinfo",  &getblockfilecacheinfo,  true,      false },
+    { "getmessagehandlerinfo",  &getmessagehandlerinfo,  true,      false },
     { "gettxout",               &gettxout,               true,      false },
     { "lockunspent",            &lockunspent,            false,     false },
     { "listlockunspent",        &listlockunspent,        false,     false },
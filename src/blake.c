@@ -638,6 +638,26 @@ sph_blake256_addbits_and_close(void *cc, unsigned ub, unsigned n, void *dst)
 	sph_blake256_init(cc);
 }
 
+/* see sph_blake.h */
+void
+sph_blake256_midstate(void *cc, const void *data)
+{
+	blake32_init(cc, IV256, salt_zero_small);
+	blake32(cc, data, 64);
+}
+
+/* see sph_blake.h */
+void
+sph_blake256_close_midstate(const void *cc,
+	const void *data, size_t len, void *dst)
+{
+	sph_blake_small_context sc;
+
+	memcpy(&sc, cc, sizeof sc);
+	blake32(&sc, data, len);
+	blake32_close(&sc, 0, 0, dst, 8);
+}
+
 
 
 #ifdef __cplusplus
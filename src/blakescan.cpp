@@ -0,0 +1,238 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "simd.h"
+
+//
+// Nonce scanning for the built-in miner.
+//
+// A block header is 80 bytes: the first 64 are compressed once into a
+// midstate, the second (final) Blake-256 block holds the remaining 16 header
+// bytes plus padding. The only word that changes from one nonce to the next
+// is message word M3, so several nonces can run through the final
+// compression side by side, one per SIMD lane.
+//
+
+static const unsigned int pBlakeSigma[8][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 }
+};
+
+static const uint32_t pBlakeConst[16] = {
+    0x243F6A88, 0x85A308D3, 0x13198A2E, 0x03707344,
+    0xA4093822, 0x299F31D0, 0x082EFA98, 0xEC4E6C89,
+    0x452821E6, 0x38D01377, 0xBE5466CF, 0x34E90C6C,
+    0xC0AC29B7, 0xC97C50DD, 0x3F84D5B5, 0xB5470917
+};
+
+// Bit length of an 80 byte header, which is also the final block counter
+static const uint32_t nHeaderBits = 640;
+
+typedef bool (*ScanNoncesFn)(const sph_blake256_context& ctxMidstate, const unsigned char* pchTail,
+                             unsigned int nStart, unsigned int nCount, const uint256& hashTarget,
+                             unsigned int& nNonceFound, uint256& hashFound);
+
+static bool ScanNoncesScalar(const sph_blake256_context& ctxMidstate, const unsigned char* pchTail,
+                             unsigned int nStart, unsigned int nCount, const uint256& hashTarget,
+                             unsigned int& nNonceFound, uint256& hashFound)
+{
+    unsigned char pchData[16];
+    memcpy(pchData, pchTail, 12);
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        unsigned int nNonce = nStart + i;
+        memcpy(pchData + 12, &nNonce, 4);
+        uint256 hash;
+        sph_blake256_close_midstate(&ctxMidstate, pchData, sizeof(pchData), BEGIN(hash));
+        if (hash <= hashTarget)
+        {
+            nNonceFound = nNonce;
+            hashFound = hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef USE_SIMD
+
+// Final block compression over NLANES nonces. Expects the vector primitives
+// VADD, VXOR, VROTR and VSET1 to be defined for the lane type.
+#define BLAKESCAN_G(m0, m1, c0, c1, a, b, c, d) do { \
+        a = VADD(VADD(a, b), VXOR(m0, VSET1(c1))); \
+        d = VROTR(VXOR(d, a), 16); \
+        c = VADD(c, d); \
+        b = VROTR(VXOR(b, c), 12); \
+        a = VADD(VADD(a, b), VXOR(m1, VSET1(c0))); \
+        d = VROTR(VXOR(d, a), 8); \
+        c = VADD(c, d); \
+        b = VROTR(VXOR(b, c), 7); \
+    } while (0)
+
+#define BLAKESCAN_GR(r, i, a, b, c, d) \
+    BLAKESCAN_G(M[pBlakeSigma[r][2*i]], M[pBlakeSigma[r][2*i+1]], \
+                pBlakeConst[pBlakeSigma[r][2*i]], pBlakeConst[pBlakeSigma[r][2*i+1]], a, b, c, d)
+
+#define BLAKESCAN_COMPRESS(VTYPE) do { \
+        VTYPE V0 = H[0], V1 = H[1], V2 = H[2], V3 = H[3]; \
+        VTYPE V4 = H[4], V5 = H[5], V6 = H[6], V7 = H[7]; \
+        VTYPE V8 = VSET1(pBlakeConst[0]), V9 = VSET1(pBlakeConst[1]); \
+        VTYPE VA = VSET1(pBlakeConst[2]), VB = VSET1(pBlakeConst[3]); \
+        VTYPE VC = VSET1(nHeaderBits ^ pBlakeConst[4]), VD = VSET1(nHeaderBits ^ pBlakeConst[5]); \
+        VTYPE VE = VSET1(pBlakeConst[6]), VF = VSET1(pBlakeConst[7]); \
+        for (int r = 0; r < 8; r++) \
+        { \
+            BLAKESCAN_GR(r, 0, V0, V4, V8, VC); \
+            BLAKESCAN_GR(r, 1, V1, V5, V9, VD); \
+            BLAKESCAN_GR(r, 2, V2, V6, VA, VE); \
+            BLAKESCAN_GR(r, 3, V3, V7, VB, VF); \
+            BLAKESCAN_GR(r, 4, V0, V5, VA, VF); \
+            BLAKESCAN_GR(r, 5, V1, V6, VB, VC); \
+            BLAKESCAN_GR(r, 6, V2, V7, V8, VD); \
+            BLAKESCAN_GR(r, 7, V3, V4, V9, VE); \
+        } \
+        OUT[0] = VXOR(H[0], VXOR(V0, V8)); \
+        OUT[1] = VXOR(H[1], VXOR(V1, V9)); \
+        OUT[2] = VXOR(H[2], VXOR(V2, VA)); \
+        OUT[3] = VXOR(H[3], VXOR(V3, VB)); \
+        OUT[4] = VXOR(H[4], VXOR(V4, VC)); \
+        OUT[5] = VXOR(H[5], VXOR(V5, VD)); \
+        OUT[6] = VXOR(H[6], VXOR(V6, VE)); \
+        OUT[7] = VXOR(H[7], VXOR(V7, VF)); \
+    } while (0)
+
+// Lane loop shared by the SIMD kernels: set up the constant message words,
+// run BLAKESCAN_COMPRESS for each group of NLANES nonces and check the
+// lanes against the target, finishing any remainder with the scalar code.
+#define BLAKESCAN_LOOP(VTYPE, NLANES) do { \
+        VTYPE H[8], M[16], OUT[8]; \
+        for (int i = 0; i < 8; i++) \
+            H[i] = VSET1(ctxMidstate.H[i]); \
+        for (int i = 0; i < 16; i++) \
+            M[i] = VSET1(0); \
+        M[0] = VSET1(ReadBE32(pchTail)); \
+        M[1] = VSET1(ReadBE32(pchTail + 4)); \
+        M[2] = VSET1(ReadBE32(pchTail + 8)); \
+        M[4] = VSET1(0x80000000); \
+        M[13] = VSET1(1); \
+        M[15] = VSET1(nHeaderBits); \
+        uint32_t nTargetTop; \
+        memcpy(&nTargetTop, hashTarget.begin() + 28, 4); \
+        unsigned int n = 0; \
+        for (; n + NLANES <= nCount; n += NLANES) \
+        { \
+            uint32_t pnNonce[NLANES]; \
+            for (int i = 0; i < NLANES; i++) \
+                pnNonce[i] = ByteReverse(nStart + n + i); \
+            M[3] = VLOAD(pnNonce); \
+            BLAKESCAN_COMPRESS(VTYPE); \
+            uint32_t pnOut[8][NLANES]; \
+            for (int i = 0; i < 8; i++) \
+                VSTORE(pnOut[i], OUT[i]); \
+            for (int i = 0; i < NLANES; i++) \
+            { \
+                /* Cheap check on the most significant word first */ \
+                if (ByteReverse(pnOut[7][i]) > nTargetTop) \
+                    continue; \
+                uint256 hash; \
+                for (int k = 0; k < 8; k++) \
+                    WriteBE32(hash.begin() + 4 * k, pnOut[k][i]); \
+                if (hash <= hashTarget) \
+                { \
+                    nNonceFound = nStart + n + i; \
+                    hashFound = hash; \
+                    return true; \
+                } \
+            } \
+        } \
+        return ScanNoncesScalar(ctxMidstate, pchTail, nStart + n, nCount - n, hashTarget, nNonceFound, hashFound); \
+    } while (0)
+
+#define SIMD_LANES 4
+#include "simdlanes.h"
+
+__attribute__((target("sse2")))
+static bool ScanNoncesSSE2(const sph_blake256_context& ctxMidstate, const unsigned char* pchTail,
+                           unsigned int nStart, unsigned int nCount, const uint256& hashTarget,
+                           unsigned int& nNonceFound, uint256& hashFound)
+{
+    BLAKESCAN_LOOP(__m128i, 4);
+}
+
+#undef SIMD_LANES
+#define SIMD_LANES 8
+#include "simdlanes.h"
+
+__attribute__((target("avx2")))
+static bool ScanNoncesAVX2(const sph_blake256_context& ctxMidstate, const unsigned char* pchTail,
+                           unsigned int nStart, unsigned int nCount, const uint256& hashTarget,
+                           unsigned int& nNonceFound, uint256& hashFound)
+{
+    BLAKESCAN_LOOP(__m256i, 8);
+}
+
+#undef SIMD_LANES
+#include "simdlanes.h"
+
+// Compare a kernel against sph_blake256 on a fixed header, so a broken
+// compiler or CPU never makes the miner skip valid nonces.
+static bool ScanNoncesSelfTest(ScanNoncesFn fn)
+{
+    CBlockHeader header;
+    header.nVersion = CBlockHeader::CURRENT_VERSION;
+    header.hashPrevBlock = Hashblake(BEGIN(header.nVersion), END(header.nVersion));
+    header.hashMerkleRoot = Hashblake(BEGIN(header.hashPrevBlock), END(header.hashPrevBlock));
+    header.nTime = 1372066561;
+    header.nBits = 0x1c02b9c4;
+
+    sph_blake256_context ctxMidstate;
+    header.GetMidstate(ctxMidstate);
+    const unsigned char* pchTail = (const unsigned char*)BEGIN(header.nVersion) + 64;
+
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        header.nNonce = 1000 + i;
+        uint256 hashTarget = header.GetHash();
+        unsigned int nNonceFound, nNonceExpected;
+        uint256 hashFound, hashExpected;
+        if (!fn(ctxMidstate, pchTail, 1000, 16, hashTarget, nNonceFound, hashFound))
+            return false;
+        ScanNoncesScalar(ctxMidstate, pchTail, 1000, 16, hashTarget, nNonceExpected, hashExpected);
+        if (nNonceFound != nNonceExpected || hashFound != hashExpected)
+            return false;
+    }
+    return true;
+}
+
+#endif
+
+static ScanNoncesFn SelectScanNonces()
+{
+#ifdef USE_SIMD
+    return SelectSIMDKernel("ScanNonces()", "Blake-256", ScanNoncesScalar,
+                            ScanNoncesSSE2, ScanNoncesAVX2, ScanNoncesSelfTest);
+#else
+    printf("ScanNonces() : using scalar Blake-256 kernel\n");
+    return ScanNoncesScalar;
+#endif
+}
+
+bool ScanNonces(const CBlockHeader& header, unsigned int nStart, unsigned int nCount, const uint256& hashTarget,
+                unsigned int& nNonceFound, uint256& hashFound)
+{
+    static const ScanNoncesFn fn = SelectScanNonces();
+
+    sph_blake256_context ctxMidstate;
+    header.GetMidstate(ctxMidstate);
+    const unsigned char* pchTail = (const unsigned char*)BEGIN(header.nVersion) + 64;
+    return fn(ctxMidstate, pchTail, nStart, nCount, hashTarget, nNonceFound, hashFound);
+}
@@ -0,0 +1,222 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+//
+// Reads of blk/rev files go through a small LRU of memory-mapped files, so
+// serving blocks, reorgs and txindex lookups do not pay an open, seek and
+// close for every record. Blocks are only ever appended, and writes through
+// the stdio handles show up in shared mappings, so a mapping only has to be
+// renewed when a record lies past its end. Where mapping is unavailable the
+// record is read into a buffer instead.
+//
+
+// Enough for the files touched by a reorg or a syncing peer, while keeping
+// 32-bit address space free
+static const unsigned int nMaxMappedFiles = sizeof(void*) >= 8 ? 64 : 4;
+
+static std::string GetBlockFilePath(int nFile, const char *prefix)
+{
+    return (GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, nFile)).string();
+}
+
+// Parse the message start and size in front of a record
+static bool ParseRecordHeader(const char *pch, unsigned int &nSize)
+{
+    if (memcmp(pch, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return error("ParseRecordHeader() : message start mismatch");
+    memcpy(&nSize, pch + sizeof(pchMessageStart), sizeof(nSize));
+    if (nSize > MAX_SIZE)
+        return error("ParseRecordHeader() : record size %u too large", nSize);
+    return true;
+}
+
+CBlockFileData::~CBlockFileData()
+{
+#ifndef WIN32
+    if (fMapped)
+        munmap((void*)pbegin, nSize);
+#endif
+}
+
+bool CBlockFileData::Map(const std::string &strPath)
+{
+#ifdef WIN32
+    return false;
+#else
+    int fd = open(strPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    pbegin = (const char*)p;
+    nSize = st.st_size;
+    fMapped = true;
+    return true;
+#endif
+}
+
+bool CBlockFileData::ReadRecord(const std::string &strPath, unsigned int nPos, unsigned int nTrailer)
+{
+    FILE *file = fopen(strPath.c_str(), "rb");
+    if (!file)
+        return error("CBlockFileData::ReadRecord() : unable to open %s", strPath.c_str());
+    char pchHeader[8];
+    unsigned int nRecordSize;
+    bool fOk = fseek(file, nPos - sizeof(pchHeader), SEEK_SET) == 0 &&
+               fread(pchHeader, 1, sizeof(pchHeader), file) == sizeof(pchHeader) &&
+               ParseRecordHeader(pchHeader, nRecordSize);
+    if (fOk) {
+        vch.resize(nRecordSize + nTrailer);
+        fOk = vch.empty() || fread(&vch[0], 1, vch.size(), file) == vch.size();
+    }
+    fclose(file);
+    if (!fOk)
+        return error("CBlockFileData::ReadRecord() : unable to read record at %u of %s", nPos, strPath.c_str());
+    pbegin = vch.empty() ? NULL : &vch[0];
+    nSize = vch.size();
+    return true;
+}
+
+class CBlockFileCache
+{
+private:
+    struct CEntry {
+        boost::shared_ptr<CBlockFileData> data;
+        uint64 nLastUsed;
+    };
+
+    typedef std::map<std::pair<std::string, int>, CEntry> EntryMap;
+
+    CCriticalSection cs;
+    EntryMap mapFiles;
+    uint64 nUseClock;
+    CBlockFileCacheStats stats;
+
+public:
+    CBlockFileCache() : nUseClock(0) {}
+
+    // Mapping of a file that covers at least its first nMinSize bytes, or NULL
+    boost::shared_ptr<CBlockFileData> Get(const char *prefix, int nFile, uint64 nMinSize)
+    {
+        LOCK(cs);
+        std::pair<std::string, int> key(prefix, nFile);
+        EntryMap::iterator it = mapFiles.find(key);
+        if (it != mapFiles.end() && it->second.data->nSize >= nMinSize) {
+            stats.nHits++;
+            it->second.nLastUsed = ++nUseClock;
+            return it->second.data;
+        }
+
+        // Not mapped yet, or the file grew past the mapping
+        stats.nMisses++;
+        if (it != mapFiles.end()) {
+            stats.nBytesMapped -= it->second.data->nSize;
+            mapFiles.erase(it);
+        }
+        boost::shared_ptr<CBlockFileData> data(new CBlockFileData());
+        if (!data->Map(GetBlockFilePath(nFile, prefix)))
+            return boost::shared_ptr<CBlockFileData>();
+
+        while (mapFiles.size() >= nMaxMappedFiles) {
+            EntryMap::iterator itOldest = mapFiles.begin();
+            for (EntryMap::iterator mi = mapFiles.begin(); mi != mapFiles.end(); mi++)
+                if (mi->second.nLastUsed < itOldest->second.nLastUsed)
+                    itOldest = mi;
+            stats.nBytesMapped -= itOldest->second.data->nSize;
+            stats.nEvictions++;
+            mapFiles.erase(itOldest);
+        }
+        CEntry &entry = mapFiles[key];
+        entry.data = data;
+        entry.nLastUsed = ++nUseClock;
+        stats.nBytesMapped += data->nSize;
+        if (data->nSize < nMinSize)
+            return boost::shared_ptr<CBlockFileData>();
+        return data;
+    }
+
+    void Close(int nFile)
+    {
+        LOCK(cs);
+        const char *prefixes[] = { "blk", "rev" };
+        for (unsigned int i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+            EntryMap::iterator it = mapFiles.find(std::make_pair(std::string(prefixes[i]), nFile));
+            if (it != mapFiles.end()) {
+                stats.nBytesMapped -= it->second.data->nSize;
+                mapFiles.erase(it);
+            }
+        }
+    }
+
+    void CountBufferedRead()
+    {
+        LOCK(cs);
+        stats.nBufferedReads++;
+    }
+
+    void GetStats(CBlockFileCacheStats &statsRet)
+    {
+        LOCK(cs);
+        statsRet = stats;
+        statsRet.nFilesMapped = mapFiles.size();
+    }
+};
+
+static CBlockFileCache blockfilecache;
+
+bool OpenBlockFileRecord(const CDiskBlockPos &pos, const char *prefix, unsigned int nTrailer, CBlockFileStream &stream)
+{
+    static const unsigned int nHeaderSize = 8;
+    if (pos.IsNull() || pos.nPos < nHeaderSize)
+        return error("OpenBlockFileRecord() : invalid position");
+
+    boost::shared_ptr<CBlockFileData> data = blockfilecache.Get(prefix, pos.nFile, pos.nPos);
+    if (data) {
+        unsigned int nSize;
+        if (!ParseRecordHeader(data->pbegin + pos.nPos - nHeaderSize, nSize))
+            return false;
+        uint64 nEnd = (uint64)pos.nPos + nSize + nTrailer;
+        if (nEnd > data->nSize)
+            data = blockfilecache.Get(prefix, pos.nFile, nEnd);
+        if (data) {
+            stream.Init(data, data->pbegin + pos.nPos, data->pbegin + nEnd);
+            return true;
+        }
+    }
+
+    blockfilecache.CountBufferedRead();
+    data.reset(new CBlockFileData());
+    if (!data->ReadRecord(GetBlockFilePath(pos.nFile, prefix), pos.nPos, nTrailer))
+        return false;
+    stream.Init(data, data->pbegin, data->pbegin + data->nSize);
+    return true;
+}
+
+void CloseBlockFileMappings(int nFile)
+{
+    blockfilecache.Close(nFile);
+}
+
+void GetBlockFileCacheStats(CBlockFileCacheStats &stats)
+{
+    blockfilecache.GetStats(stats);
+}
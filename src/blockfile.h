@@ -0,0 +1,129 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+
+/** Bytes of a blk/rev file: either the whole file mapped into memory, or
+ *  a single record read into a buffer where mapping is not available */
+class CBlockFileData
+{
+public:
+    const char *pbegin;
+    size_t nSize;
+
+private:
+    bool fMapped;
+    std::vector<char> vch;
+
+    CBlockFileData(const CBlockFileData&);
+    void operator=(const CBlockFileData&);
+
+public:
+    CBlockFileData() : pbegin(NULL), nSize(0), fMapped(false) {}
+    ~CBlockFileData();
+
+    bool Map(const std::string &strPath);
+    bool ReadRecord(const std::string &strPath, unsigned int nPos, unsigned int nTrailer);
+    bool IsMapped() const { return fMapped; }
+};
+
+/** Read-only stream over one record (a block, or undo data and its
+ *  checksum) of a blk/rev file. Unserializes like CDataStream, straight
+ *  from the mapped file, and keeps the mapping alive while it exists.
+ */
+class CBlockFileStream
+{
+private:
+    boost::shared_ptr<CBlockFileData> data;
+    const char *pcur;
+    const char *pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBlockFileStream(int nTypeIn, int nVersionIn) : pcur(NULL), pend(NULL), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    void Init(const boost::shared_ptr<CBlockFileData> &dataIn, const char *pbeginIn, const char *pendIn)
+    {
+        data = dataIn;
+        pcur = pbeginIn;
+        pend = pendIn;
+    }
+
+    const char *begin() const { return pcur; }
+    const char *end() const { return pend; }
+    size_t size() const { return pend - pcur; }
+    bool empty() const { return pcur == pend; }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    CBlockFileStream& read(char *pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CBlockFileStream::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CBlockFileStream& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CBlockFileStream::ignore() : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBlockFileStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // The remaining bytes serialize as they are, like a CDataStream
+    unsigned int GetSerializeSize(int, int=0) const
+    {
+        return size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int, int=0) const
+    {
+        if (!empty())
+            s.write(pcur, size());
+    }
+};
+
+/** Statistics of the block file cache */
+struct CBlockFileCacheStats
+{
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+    uint64 nBufferedReads;
+    unsigned int nFilesMapped;
+    uint64 nBytesMapped;
+
+    CBlockFileCacheStats() : nHits(0), nMisses(0), nEvictions(0), nBufferedReads(0), nFilesMapped(0), nBytesMapped(0) {}
+};
+
+/** Open the record stored at pos in a blk (prefix "blk") or rev ("rev")
+ *  file: the data behind its message start and size, plus nTrailer bytes */
+bool OpenBlockFileRecord(const CDiskBlockPos &pos, const char *prefix, unsigned int nTrailer, CBlockFileStream &stream);
+/** Drop the mappings of a block file and its undo file, e.g. before truncating them */
+void CloseBlockFileMappings(int nFile);
+void GetBlockFileCacheStats(CBlockFileCacheStats &stats);
+
+#endif
@@ -0,0 +1,29 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKMAP_H
+#define BITCOIN_BLOCKMAP_H
+
+#include "uint256.h"
+
+#include <string.h>
+#include <boost/unordered_map.hpp>
+
+class CBlockIndex;
+
+/** Block hashes are already uniformly distributed, so their low bits can be
+ * used as the hash table key directly. */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const
+    {
+        size_t nKey;
+        memcpy(&nKey, hash.begin(), sizeof(nKey));
+        return nKey;
+    }
+};
+/** Node based, so the key addresses that CBlockIndex::phashBlock points to stay valid on rehash */
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+#endif
@@ -7,8 +7,10 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/detail/atomic_count.hpp>
 
 #include <vector>
+#include <deque>
 #include <algorithm>
 
 template<typename T> class CCheckQueueControl;
@@ -21,10 +23,28 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker (and the master) owns a deque. Batches pushed by the master
+  * are dealt round-robin over the deques; a worker takes work from the back
+  * of its own deque and, when that runs dry, steals from the front of the
+  * others. Each deque has its own mutex, so busy workers do not contend on
+  * shared state: the queue-wide mutex is only taken to go to sleep, to wake
+  * sleepers up, and when the last check completes.
   */
 template<typename T> class CCheckQueue {
 private:
-    // Mutex to protect the inner state
+    // Upper bound on the number of deques (workers plus the master)
+    static const int nMaxQueues = 64;
+
+    struct WorkQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
+    // Per-worker deques; slot 0 belongs to the master
+    WorkQueue vQueues[nMaxQueues];
+
+    // Mutex protecting the sleep/wake state below
     boost::mutex mutex;
 
     // Worker threads block on this when out of work
@@ -33,23 +53,30 @@ private:
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    // Bumped on every Add, so sleeping workers can tell new work arrived
+    unsigned int nGeneration;
+
+    // The number of deques in use (workers registered so far, plus the master).
+    // Only grows, under mutex; read without it by Add and GetWork.
+    boost::detail::atomic_count nQueues;
 
-    // The number of workers (including the master) that are idle.
+    // The deque that receives the next batch
+    int nNextQueue;
+
+    // The number of workers (excluding the master) that are idle.
     int nIdle;
 
-    // The total number of workers (including the master).
+    // The total number of workers (excluding the master).
     int nTotal;
 
-    // The temporary evaluation result.
-    bool fAllOk;
-
     // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
+    // This includes elements that are not anymore in a deque, but still in
     // worker's own batches.
-    unsigned int nTodo;
+    boost::detail::atomic_count nTodo;
+
+    // Number of failed verifications; the current round failed if this moved past nFailedBase
+    boost::detail::atomic_count nFailed;
+    long nFailedBase;
 
     // Whether we're shutting down.
     bool fQuit;
@@ -57,70 +84,112 @@ private:
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    bool AllOk() const {
+        return nFailed == nFailedBase;
+    }
+
+    // Move up to nBatchSize checks into vChecks: from the back of our own
+    // deque if possible, otherwise half of someone else's, from the front.
+    bool GetWork(int nSelf, std::vector<T> &vChecks) {
+        {
+            WorkQueue &own = vQueues[nSelf];
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            unsigned int nNow = std::min(nBatchSize, (unsigned int)own.queue.size());
+            if (nNow) {
+                vChecks.resize(nNow);
+                for (unsigned int i = 0; i < nNow; i++) {
+                    vChecks[i].swap(own.queue.back());
+                    own.queue.pop_back();
+                }
+                return true;
+            }
+        }
+        int nCount = (int)nQueues;
+        for (int n = 1; n < nCount; n++) {
+            WorkQueue &victim = vQueues[(nSelf + n) % nCount];
+            boost::unique_lock<boost::mutex> lock(victim.mutex);
+            unsigned int nSize = victim.queue.size();
+            if (nSize == 0)
+                continue;
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, nSize / 2));
+            vChecks.resize(nNow);
+            for (unsigned int i = 0; i < nNow; i++) {
+                vChecks[i].swap(victim.queue.front());
+                victim.queue.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Run a batch (unless an earlier check already failed) and account for it
+    void Execute(std::vector<T> &vChecks, bool fMaster) {
+        bool fOk = AllOk();
+        BOOST_FOREACH(T &check, vChecks)
+            if (fOk)
+                fOk = check();
+        if (!fOk)
+            ++nFailed;
+        bool fLast = false;
+        for (unsigned int i = 0; i < vChecks.size(); i++)
+            fLast = (--nTodo == 0);
+        vChecks.clear();
+        if (fLast && !fMaster) {
+            // We processed the last element; inform the master he can exit and return the result
+            boost::unique_lock<boost::mutex> lock(mutex);
+            condMaster.notify_one();
+        }
+    }
+
     // Internal function that does bulk of the verification work.
     bool Loop(bool fMaster = false) {
-        boost::condition_variable &cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
+        int nSelf = 0;
+        unsigned int nSeen;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fMaster) {
+                assert(nQueues < nMaxQueues);
+                nSelf = (int)++nQueues - 1;
+                nTotal++;
+            }
+            nSeen = nGeneration;
+        }
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+            if (GetWork(nSelf, vChecks)) {
+                Execute(vChecks, fMaster);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster) {
+                // Every deque is empty: wait for the batches still held by workers
+                while (nTodo != 0)
+                    condMaster.wait(lock);
+                bool fRet = AllOk();
+                // reset the status for new work later
+                nFailedBase = nFailed;
+                return fRet;
+            }
+            if (fQuit) {
+                nTotal--;
+                return AllOk();
             }
-            // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            if (nGeneration == nSeen) {
+                nIdle++;
+                while (nGeneration == nSeen && !fQuit)
+                    condWorker.wait(lock); // wait
+                nIdle--;
+            }
+            nSeen = nGeneration;
         } while(true);
     }
 
 public:
     // Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+        nGeneration(0), nQueues(1), nNextQueue(0), nIdle(0), nTotal(0), nTodo(0), nFailed(0), nFailedBase(0),
+        fQuit(false), nBatchSize(nBatchSizeIn) {}
 
     // Worker thread
     void Thread() {
@@ -134,15 +203,26 @@ public:
 
     // Add a batch of checks to the queue
     void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        for (unsigned int i = 0; i < vChecks.size(); i++)
+            ++nTodo;
+        // Only the master adds, so nNextQueue needs no protection
+        WorkQueue &target = vQueues[nNextQueue++ % (int)nQueues];
+        {
+            boost::unique_lock<boost::mutex> lock(target.mutex);
+            BOOST_FOREACH(T &check, vChecks) {
+                target.queue.push_back(T());
+                check.swap(target.queue.back());
+            }
         }
-        nTodo += vChecks.size();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nGeneration++;
+        if (nIdle == 0)
+            return;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -164,9 +244,8 @@ public:
     CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
             assert(pqueue->nTodo == 0);
-            assert(pqueue->fAllOk == true);
+            assert(pqueue->AllOk());
         }
     }
 
@@ -24,6 +24,12 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <ifaddrs.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#define USE_EPOLL 1
+#include <sys/epoll.h>
 #endif
 
 typedef u_int SOCKET;
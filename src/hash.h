@@ -78,6 +78,10 @@ inline uint256 Hash4(const T1 p1begin, const T1 p1end,
     return hash2;
 }
 
+/** Compute pOut[i] = Hash4(pIn[2*i], pIn[2*i+1]) for nPairs consecutive pairs of merkle
+    tree nodes, several pairs at a time when the CPU allows */
+void MerkleHashPairs(const uint256* pIn, uint256* pOut, unsigned int nPairs);
+
 template<typename T>
 uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
 {
@@ -106,8 +106,11 @@ void Shutdown()
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
         if (pblocktree)
             pblocktree->Flush();
-        if (pcoinsTip)
-            pcoinsTip->Flush();
+        StopBlockPrecheckThreads();
+        StopCoinsPrefetchThreads();
+        StopCoinsFlushThread();
+        if (pcoinsTip && !FlushCoinsTip(false))
+            printf("Shutdown : error: failed to write the coin database\n");
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
@@ -298,6 +301,9 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
+        "  -limitancestorcount=<n> " + _("Do not relay transactions with more than <n> unconfirmed ancestors or descendants, counting themselves (default: 25)") + "\n" +
+        "  -limitancestorsize=<n> " + _("Do not relay transactions with more than <n> kilobytes of unconfirmed ancestors or descendants (default: 101)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -319,6 +325,7 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -msghandlerthreads=<n> " + _("Set the number of threads processing peer messages (up to 16, default: 2)") + "\n" +
         "  -bloomfilters          " + _("Allow peers to set bloom filters (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -361,10 +368,13 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
+        "  -checkblockindexpow    " + _("Re-hash and check the proof-of-work of every block index entry at startup (default: 1)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -precheckthreads=<n>   " + _("Set the number of threads checking received blocks ahead of connection (up to 16, 0 = disable, default: 2)") + "\n" +
+        "  -prefetchthreads=<n>   " + _("Set the number of threads reading spent coins ahead of block connection (up to 16, 0 = disable, default: 4)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -537,9 +547,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifdef WIN32
+    // select() cannot wait for more than FD_SETSIZE sockets
+    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -560,6 +573,28 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nBlockPrecheckThreads = GetArg("-precheckthreads", 2);
+    if (nBlockPrecheckThreads < 0)
+        nBlockPrecheckThreads = 0;
+    else if (nBlockPrecheckThreads > MAX_BLOCK_PRECHECK_THREADS)
+        nBlockPrecheckThreads = MAX_BLOCK_PRECHECK_THREADS;
+
+    nCoinsPrefetchThreads = GetArg("-prefetchthreads", 4);
+    if (nCoinsPrefetchThreads < 0)
+        nCoinsPrefetchThreads = 0;
+    else if (nCoinsPrefetchThreads > MAX_COINS_PREFETCH_THREADS)
+        nCoinsPrefetchThreads = MAX_COINS_PREFETCH_THREADS;
+
+    nMaxMempoolUsage = (size_t)std::max(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE), (int64)1) << 20;
+    nMempoolAncestorLimit = (unsigned int)std::max(GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT), (int64)1);
+    nMempoolAncestorSizeLimit = (unsigned int)std::max(GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT), (int64)1) * 1000;
+
+    nMessageHandlerThreads = GetArg("-msghandlerthreads", 2);
+    if (nMessageHandlerThreads < 1)
+        nMessageHandlerThreads = 1;
+    else if (nMessageHandlerThreads > MAX_MESSAGE_HANDLER_THREADS)
+        nMessageHandlerThreads = MAX_MESSAGE_HANDLER_THREADS;
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -849,7 +884,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the remainder is the in-memory coins cache budget, in bytes
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -938,7 +973,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
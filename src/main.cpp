@@ -32,7 +32,53 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+// Shared by ConnectBlock and CTxMemPool::accept, which both only use it with cs_main held
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+BlockMap mapBlockIndex;
+
+// Block index entries live until shutdown and are never freed one by one, so
+// they are carved out of large slabs instead of one heap allocation each
+class CBlockIndexPool
+{
+private:
+    static const size_t nSlabSize = 4096;
+    std::vector<CBlockIndex*> vSlabs;
+    size_t nUsed; // entries used in the last slab
+
+    void* Allocate()
+    {
+        if (vSlabs.empty() || nUsed == nSlabSize)
+        {
+            vSlabs.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * nSlabSize)));
+            nUsed = 0;
+        }
+        return vSlabs.back() + nUsed++;
+    }
+
+public:
+    CBlockIndexPool() : nUsed(0) {}
+    ~CBlockIndexPool() { Clear(); }
+
+    CBlockIndex* New() { return new (Allocate()) CBlockIndex(); }
+    CBlockIndex* New(CBlockHeader& block) { return new (Allocate()) CBlockIndex(block); }
+
+    void Clear()
+    {
+        for (unsigned int i = 0; i < vSlabs.size(); i++)
+        {
+            size_t nEntries = (i + 1 == vSlabs.size() ? nUsed : nSlabSize);
+            for (size_t j = 0; j < nEntries; j++)
+                vSlabs[i][j].~CBlockIndex();
+            ::operator delete(vSlabs[i]);
+        }
+        vSlabs.clear();
+        nUsed = 0;
+    }
+};
+static CBlockIndexPool poolBlockIndex;
+// The active chain indexed by height (protected by cs_main)
+vector<CBlockIndex*> vBlockIndexByHeight;
 uint256 hashGenesisBlock("0x000000ba5cae4648b1a2b823f84cc3424e5d96d7234b39c6bb42800b2c7639be");
 static const unsigned int timeGenesisBlock = 1381036817;
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 24);
@@ -45,11 +91,16 @@ CBlockIndex* pindexBest = NULL;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+int nCoinsPrefetchThreads = 0;
+int nBlockPrecheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
+size_t nMaxMempoolUsage = (size_t)DEFAULT_MAX_MEMPOOL_SIZE << 20;
+unsigned int nMempoolAncestorLimit = DEFAULT_ANCESTOR_LIMIT;
+unsigned int nMempoolAncestorSizeLimit = DEFAULT_ANCESTOR_SIZE_LIMIT * 1000;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 10000;  // Override with -mintxfee
@@ -175,7 +226,7 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -186,43 +237,106 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsKeyHasher::CCoinsKeyHasher() {
+    uint256 salt = GetRandHash();
+    memcpy(&k0, salt.begin(), sizeof(k0));
+    memcpy(&k1, salt.begin() + sizeof(k0), sizeof(k1));
+}
 
-bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
+// Approximate per-entry cost: the map node (key, entry and chaining pointer) plus the CCoins heap data
+static inline size_t CoinsEntryUsage(const CCoins &coins) {
+    return sizeof(CCoinsMap::value_type) + 2 * sizeof(void*) + coins.DynamicMemoryUsage();
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0), nUseClock(0), pentryModified(NULL) { }
+
+void CCoinsViewCache::UpdateUsage(CCoinsCacheEntry &entry) {
+    size_t nUsage = CoinsEntryUsage(entry.coins);
+    cachedCoinsUsage = cachedCoinsUsage - entry.nUsage + nUsage;
+    entry.nUsage = nUsage;
+}
+
+void CCoinsViewCache::SettleModified() {
+    if (pentryModified) {
+        UpdateUsage(*pentryModified);
+        pentryModified = NULL;
     }
-    return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it == cacheCoins.end())
+        return false;
+    coins = it->second.coins;
+    return true;
+}
+
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    SettleModified();
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end()) {
+        it->second.nLastUsed = nUseClock;
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coins);
+    ret->second.nLastUsed = nUseClock;
+    UpdateUsage(ret->second);
     return ret;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoins(txid);
+    assert(it != cacheCoins.end());
+    it->second.flags |= CCoinsCacheEntry::DIRTY;
+    pentryModified = &it->second;
+    return it->second.coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    return it->second.coins;
+}
+
+bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) const {
+    return cacheCoins.find(txid) != cacheCoins.end();
+}
+
+void CCoinsViewCache::PrimeCoins(const uint256 &txid, CCoins &coins) {
+    SettleModified();
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (!ret.second)
+        return;
+    ret.first->second.coins.swap(coins);
+    ret.first->second.nLastUsed = nUseClock;
+    UpdateUsage(ret.first->second);
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    return SetCoins(txid, coins, false);
+}
+
+bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins, bool fFresh) {
+    SettleModified();
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it == cacheCoins.end()) {
+        // If nothing below us knows this txid, a later spend of all its
+        // outputs can simply drop the entry instead of writing it out.
+        it = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+        if (fFresh)
+            it->second.flags |= CCoinsCacheEntry::FRESH;
+    }
+    it->second.coins = coins;
+    it->second.flags |= CCoinsCacheEntry::DIRTY;
+    it->second.nLastUsed = nUseClock;
+    UpdateUsage(it->second);
     return true;
 }
 
@@ -238,20 +352,49 @@ CBlockIndex *CCoinsViewCache::GetBestBlock() {
 
 bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     pindexTip = pindex;
+    nUseClock++;
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    SettleModified();
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoinsCacheEntry &child = it->second;
+        if (!(child.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // Created and fully spent in the child: nothing to record here either
+            if ((child.flags & CCoinsCacheEntry::FRESH) && child.coins.IsPruned())
+                continue;
+            itUs = cacheCoins.insert(std::make_pair(it->first, CCoinsCacheEntry())).first;
+            itUs->second.coins = child.coins;
+            itUs->second.flags = CCoinsCacheEntry::DIRTY | (child.flags & CCoinsCacheEntry::FRESH);
+            itUs->second.nLastUsed = nUseClock;
+            UpdateUsage(itUs->second);
+        } else if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && child.coins.IsPruned()) {
+            // Our parent never saw this txid, so it can be forgotten entirely
+            cachedCoinsUsage -= itUs->second.nUsage;
+            cacheCoins.erase(itUs);
+        } else {
+            itUs->second.coins = child.coins;
+            itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+            itUs->second.nLastUsed = nUseClock;
+            UpdateUsage(itUs->second);
+        }
+    }
     pindexTip = pindex;
+    nUseClock++;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    SettleModified();
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
@@ -259,6 +402,73 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    SettleModified();
+    return cachedCoinsUsage + cacheCoins.bucket_count() * sizeof(void*);
+}
+
+size_t CCoinsViewCache::DirtyUsage() {
+    SettleModified();
+    size_t nBytes = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            nBytes += it->second.nUsage;
+    return nBytes;
+}
+
+size_t CCoinsViewCache::TakeDirty(CCoinsMap &mapDirty) {
+    SettleModified();
+    size_t nBytes = 0;
+    CCoinsMap::iterator it = cacheCoins.begin();
+    while (it != cacheCoins.end()) {
+        CCoinsCacheEntry &entry = it->second;
+        if (!(entry.flags & CCoinsCacheEntry::DIRTY)) {
+            it++;
+            continue;
+        }
+        if ((entry.flags & CCoinsCacheEntry::FRESH) && entry.coins.IsPruned()) {
+            // the base never had it, so forgetting it is equivalent to writing it
+            cachedCoinsUsage -= entry.nUsage;
+            it = cacheCoins.erase(it);
+            continue;
+        }
+        CCoinsCacheEntry &copy = mapDirty[it->first];
+        copy.coins = entry.coins;
+        copy.flags = CCoinsCacheEntry::DIRTY;
+        nBytes += entry.nUsage;
+        entry.flags = 0;
+        it++;
+    }
+    return nBytes;
+}
+
+struct CompareCoinsLastUsed
+{
+    bool operator()(const std::pair<unsigned int, CCoinsMap::iterator> &a, const std::pair<unsigned int, CCoinsMap::iterator> &b) const {
+        return a.first < b.first;
+    }
+};
+
+unsigned int CCoinsViewCache::Trim(size_t nTargetUsage) {
+    size_t nBuckets = DynamicMemoryUsage() - cachedCoinsUsage;
+    if (cachedCoinsUsage + nBuckets <= nTargetUsage)
+        return 0;
+
+    std::vector<std::pair<unsigned int, CCoinsMap::iterator> > vClean;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            vClean.push_back(std::make_pair(it->second.nLastUsed, it));
+    std::sort(vClean.begin(), vClean.end(), CompareCoinsLastUsed());
+
+    unsigned int nEvicted = 0;
+    for (unsigned int i = 0; i < vClean.size() && cachedCoinsUsage + nBuckets > nTargetUsage; i++) {
+        cachedCoinsUsage -= vClean[i].second->second.nUsage;
+        cacheCoins.erase(vClean[i].second);
+        nEvicted++;
+    }
+    return nEvicted;
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -281,6 +491,327 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
+/** Writes snapshots of the dirty part of pcoinsTip to its base view on a
+ *  dedicated thread. At most one snapshot is in flight at a time, so writes
+ *  reach the database in order.
+ */
+class CCoinsFlushQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread *pthread;
+
+    // the snapshot being written, and the best block it corresponds to
+    CCoinsView *pbase;
+    CCoinsMap mapPending;
+    CBlockIndex *pindexPending;
+    size_t nPendingBytes;
+    bool fPending;
+    bool fFailed;
+    bool fQuit;
+
+    CCoinsFlushStats stats;
+
+    void Thread() {
+        RenameThread("bitcoin-coinsflush");
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            while (!fPending && !fQuit)
+                cond.wait(lock);
+            if (!fPending)
+                return;
+            // mapPending is left alone by other threads while fPending is set
+            lock.unlock();
+            int64 nStart = GetTimeMillis();
+            bool fOk = pbase->BatchWrite(mapPending, pindexPending);
+            int64 nTime = GetTimeMillis() - nStart;
+            lock.lock();
+            Record(mapPending.size(), nPendingBytes, nTime);
+            fFailed |= !fOk;
+            mapPending.clear();
+            fPending = false;
+            cond.notify_all();
+        }
+    }
+
+    void Record(unsigned int nEntries, size_t nBytes, int64 nTime) {
+        stats.nFlushes++;
+        stats.nEntriesWritten += nEntries;
+        stats.nBytesWritten += nBytes;
+        stats.nLastFlushEntries = nEntries;
+        stats.nLastFlushBytes = nBytes;
+        stats.nLastFlushTime = nTime;
+        stats.nTotalFlushTime += nTime;
+        stats.nMaxFlushTime = std::max(stats.nMaxFlushTime, nTime);
+    }
+
+public:
+    CCoinsFlushQueue() : pthread(NULL), pbase(NULL), pindexPending(NULL), nPendingBytes(0), fPending(false), fFailed(false), fQuit(false) {}
+
+    // Block until the in-flight snapshot (if any) has been written
+    bool Wait() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending) {
+            int64 nStart = GetTimeMillis();
+            while (fPending)
+                cond.wait(lock);
+            stats.nTotalWaitTime += GetTimeMillis() - nStart;
+        }
+        return !fFailed;
+    }
+
+    // Hand a snapshot to the flush thread. The caller must have called Wait() first.
+    void Push(CCoinsView *pbaseIn, CCoinsMap &mapDirty, CBlockIndex *pindex, size_t nBytes) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        assert(!fPending);
+        if (pthread == NULL)
+            pthread = new boost::thread(boost::bind(&CCoinsFlushQueue::Thread, this));
+        pbase = pbaseIn;
+        mapPending.swap(mapDirty);
+        pindexPending = pindex;
+        nPendingBytes = nBytes;
+        fPending = true;
+        cond.notify_all();
+    }
+
+    // Account for a write done synchronously by the caller
+    void RecordSync(unsigned int nEntries, size_t nBytes, int64 nTime) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        Record(nEntries, nBytes, nTime);
+    }
+
+    void RecordEvicted(unsigned int nEvicted) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stats.nEvicted += nEvicted;
+    }
+
+    void GetStats(CCoinsFlushStats &statsOut) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        statsOut = stats;
+        statsOut.fPending = fPending;
+        statsOut.nPendingBytes = fPending ? nPendingBytes : 0;
+    }
+
+    void Stop() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+            cond.notify_all();
+        }
+        if (pthread) {
+            pthread->join();
+            delete pthread;
+            pthread = NULL;
+        }
+        fQuit = false;
+    }
+};
+
+static CCoinsFlushQueue queueCoinsFlush;
+
+bool FlushCoinsTip(bool fBackground)
+{
+    // Earlier snapshots must reach the database before anything newer
+    if (!queueCoinsFlush.Wait())
+        return false;
+
+    // The snapshot is a copy of the modified entries, which stay in the
+    // cache. If the two cannot fit in the budget together, write straight
+    // from the cache instead.
+    size_t nDirty = fBackground ? pcoinsTip->DirtyUsage() : 0;
+    if (!fBackground || nDirty > nCoinCacheUsage / 2) {
+        int64 nStart = GetTimeMillis();
+        unsigned int nEntries = pcoinsTip->GetCacheSize();
+        size_t nBytes = pcoinsTip->DynamicMemoryUsage();
+        if (!pcoinsTip->Flush())
+            return false;
+        queueCoinsFlush.RecordSync(nEntries, nBytes, GetTimeMillis() - nStart);
+        return true;
+    }
+
+    // The last snapshot is on disk now, so make room for the next one by
+    // dropping the coldest clean entries
+    size_t nTarget = std::min(nCoinCacheUsage / 10 * 9, nCoinCacheUsage - nDirty);
+    if (pcoinsTip->DynamicMemoryUsage() > nTarget)
+        queueCoinsFlush.RecordEvicted(pcoinsTip->Trim(nTarget));
+
+    CCoinsMap mapDirty;
+    size_t nBytes = pcoinsTip->TakeDirty(mapDirty);
+    queueCoinsFlush.Push(pcoinsTip->GetBackend(), mapDirty, pcoinsTip->GetBestBlock(), nBytes);
+    return true;
+}
+
+void StopCoinsFlushThread()
+{
+    queueCoinsFlush.Wait();
+    queueCoinsFlush.Stop();
+}
+
+void GetCoinsFlushStats(CCoinsFlushStats &stats)
+{
+    queueCoinsFlush.GetStats(stats);
+}
+
+/** Looks up the coins spent by a block on worker threads, so that connecting
+ *  it finds them in pcoinsTip's cache instead of doing one database read
+ *  per input on the thread holding cs_main.
+ */
+class CCoinsPrefetcher
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    boost::thread_group threads;
+    int nThreads;
+    bool fQuit;
+
+    // the current job; vTxid, vCoins and vFound are only resized while no
+    // lookup is outstanding (nClaimed == nDone)
+    CCoinsView *pbase;
+    uint256 hashBlock;
+    std::vector<uint256> vTxid;
+    std::vector<CCoins> vCoins;
+    std::vector<char> vFound;
+    unsigned int nClaimed;
+    unsigned int nDone;
+    int64 nStartTime;
+
+    static const unsigned int nBatchSize = 16;
+
+    void Thread() {
+        RenameThread("bitcoin-prefetch");
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            while (nClaimed >= vTxid.size() && !fQuit)
+                condWorker.wait(lock);
+            if (fQuit)
+                return;
+            unsigned int nBegin = nClaimed;
+            unsigned int nEnd = std::min(nBegin + nBatchSize, (unsigned int)vTxid.size());
+            nClaimed = nEnd;
+            lock.unlock();
+            for (unsigned int i = nBegin; i < nEnd; i++)
+                vFound[i] = pbase->GetCoins(vTxid[i], vCoins[i]);
+            lock.lock();
+            nDone += nEnd - nBegin;
+            if (nDone == nClaimed)
+                condMaster.notify_all();
+        }
+    }
+
+    // Stop handing out lookups and wait for the outstanding ones. Requires lock.
+    void Drain(boost::unique_lock<boost::mutex> &lock) {
+        nClaimed = vTxid.size();
+        while (nDone < nClaimed)
+            condMaster.wait(lock);
+    }
+
+    void Reset() {
+        hashBlock = 0;
+        vTxid.clear();
+        vCoins.clear();
+        vFound.clear();
+        nClaimed = nDone = 0;
+    }
+
+public:
+    CCoinsPrefetcher() : nThreads(0), fQuit(false), pbase(NULL), nClaimed(0), nDone(0), nStartTime(0) {}
+
+    void Start(CCoinsView *pbaseIn, const uint256 &hashBlockIn, std::vector<uint256> &vTxidIn) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        Drain(lock);
+        Reset();
+        while (nThreads < nCoinsPrefetchThreads) {
+            threads.create_thread(boost::bind(&CCoinsPrefetcher::Thread, this));
+            nThreads++;
+        }
+        pbase = pbaseIn;
+        hashBlock = hashBlockIn;
+        vTxid.swap(vTxidIn);
+        vCoins.resize(vTxid.size());
+        vFound.resize(vTxid.size(), 0);
+        nStartTime = GetTimeMicros();
+        condWorker.notify_all();
+    }
+
+    void Finish(const uint256 &hashBlockIn, CCoinsViewCache &cache) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (vTxid.empty())
+            return;
+        if (hashBlock != hashBlockIn) {
+            // stale results must never reach the cache: the block connected
+            // in between may have changed the coins that were read
+            Drain(lock);
+            Reset();
+            return;
+        }
+        while (nDone < vTxid.size())
+            condMaster.wait(lock);
+        unsigned int nFound = 0;
+        for (unsigned int i = 0; i < vTxid.size(); i++) {
+            if (vFound[i]) {
+                cache.PrimeCoins(vTxid[i], vCoins[i]);
+                nFound++;
+            }
+        }
+        if (fBenchmark)
+            printf("- Prefetch %u/%u coins: %.2fms\n", nFound, (unsigned int)vTxid.size(), (GetTimeMicros() - nStartTime) * 0.001);
+        Reset();
+    }
+
+    void Stop() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            Drain(lock);
+            Reset();
+            fQuit = true;
+            condWorker.notify_all();
+        }
+        threads.join_all();
+        nThreads = 0;
+        fQuit = false;
+    }
+};
+
+static CCoinsPrefetcher coinsPrefetcher;
+
+void StartCoinsPrefetch(const CBlock &block)
+{
+    if (nCoinsPrefetchThreads <= 0 || pcoinsTip == NULL)
+        return;
+
+    // Outputs created inside the block are not in the database yet
+    std::set<uint256> setCreated, setSeen;
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+        setCreated.insert(tx.GetHash());
+
+    std::vector<uint256> vTxid;
+    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn &txin, tx.GetVin()) {
+            const uint256 &txid = txin.prevout.hash;
+            if (setCreated.count(txid) || pcoinsTip->HaveCoinsInCache(txid) || !setSeen.insert(txid).second)
+                continue;
+            vTxid.push_back(txid);
+        }
+    }
+    if (!vTxid.empty())
+        coinsPrefetcher.Start(pcoinsTip->GetBackend(), block.GetHash(), vTxid);
+}
+
+void FinishCoinsPrefetch(const uint256 &hashBlock)
+{
+    coinsPrefetcher.Finish(hashBlock, *pcoinsTip);
+}
+
+void StopCoinsPrefetchThreads()
+{
+    coinsPrefetcher.Stop();
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -307,7 +838,7 @@ bool AddOrphanTx(const CTransaction& tx)
     }
 
     mapOrphanTransactions[hash] = tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
     printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().c_str(),
@@ -320,7 +851,7 @@ void static EraseOrphanTx(uint256 hash)
     if (!mapOrphanTransactions.count(hash))
         return;
     const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
     {
         mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
         if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
@@ -535,7 +1066,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -660,12 +1191,9 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
     }
 }
 
-bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
-                        bool* pfMissingInputs)
+// Checks of a loose transaction that do not depend on the pool or the chain
+static bool CheckLooseTransaction(CValidationState &state, const CTransaction &tx)
 {
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
-
     if (!tx.CheckTransaction(state))
         return error("CTxMemPool::accept() : CheckTransaction failed");
 
@@ -674,7 +1202,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         return state.DoS(100, error("CTxMemPool::accept() : coinbase as individual tx"));
 
     // To help v0.1.5 clients who would see it as a negative number
-    if ((int64)tx.nLockTime > std::numeric_limits<int>::max())
+    if ((int64)tx.GetLockTime() > std::numeric_limits<int>::max())
         return error("CTxMemPool::accept() : not accepting nLockTime beyond 2038 yet");
 
     // Rather not work on nonstandard transactions (unless -testnet)
@@ -683,19 +1211,16 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         return error("CTxMemPool::accept() : nonstandard transaction (%s)",
                      strNonStd.c_str());
 
-    // is it already in the memory pool?
-    uint256 hash = tx.GetHash();
-    {
-        LOCK(cs);
-        if (mapTx.count(hash))
-            return false;
-    }
+    return true;
+}
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+// Check for conflicts with in-memory transactions
+bool CTxMemPool::CheckConflicts(const CTransaction &tx, CTransaction* &ptxOld)
+{
+    ptxOld = NULL;
+    for (unsigned int i = 0; i < tx.GetVin().size(); i++)
     {
-        COutPoint outpoint = tx.vin[i].prevout;
+        COutPoint outpoint = tx.GetVin()[i].prevout;
         if (mapNextTx.count(outpoint))
         {
             // Disable replacement feature for now
@@ -709,16 +1234,116 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
                 return false;
             if (!tx.IsNewerThan(*ptxOld))
                 return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            for (unsigned int i = 0; i < tx.GetVin().size(); i++)
             {
-                COutPoint outpoint = tx.vin[i].prevout;
+                COutPoint outpoint = tx.GetVin()[i].prevout;
                 if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
                     return false;
             }
             break;
         }
     }
+    return true;
+}
+
+// Continuously rate-limit free transactions
+// This mitigates 'penny-flooding' -- sending thousands of free transactions just to
+// be annoying or make others' transactions take longer to confirm.
+// Only a transaction going into the pool is charged for, with fCharge.
+bool CTxMemPool::RateLimitFree(unsigned int nSize, bool fCharge)
+{
+    static double dFreeCount;
+    static int64 nLastTime;
+    int64 nNow = GetTime();
+
+    LOCK(cs);
+
+    // Use an exponentially decaying ~10-minute window:
+    dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
+    nLastTime = nNow;
+    // -limitfreerelay unit is thousand-bytes-per-minute
+    // At default rate it would take over a month to fill 1GB
+    if (dFreeCount >= GetArg("-limitfreerelay", 15)*10*1000)
+        return false;
+    if (fCharge)
+    {
+        if (fDebug)
+            printf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+        dFreeCount += nSize;
+    }
+    return true;
+}
+
+// Checks of a transaction against its inputs, which view must have cached.
+// With pvChecks, the script checks are handed back instead of being run.
+// fFree is set for a transaction the free rate limiter has to be charged
+// for once it goes into the pool.
+bool CTxMemPool::CheckPoolInputs(CValidationState &state, const CTransaction &tx, const uint256 &hash, CCoinsViewCache &view,
+                                 bool fLimitFree, bool &fFree, std::vector<CScriptCheck> *pvChecks)
+{
+    fFree = false;
+
+    // are the actual inputs available?
+    if (!tx.HaveInputs(view))
+        return state.Invalid(error("CTxMemPool::accept() : inputs already spent"));
+
+    // Check for non-standard pay-to-script-hash in inputs
+    if (!tx.AreInputsStandard(view) && !fTestNet)
+        return error("CTxMemPool::accept() : nonstandard transaction input");
+
+    // Note: if you modify this code to accept non-standard transactions, then
+    // you should add code here to check that the transaction does a
+    // reasonable number of ECDSA signature verifications.
+
+    int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Don't accept it if it can't get into a block
+    int64 txMinFee = tx.GetMinFee(1000, true, GMF_RELAY);
+    if (fLimitFree && nFees < txMinFee)
+        return error("CTxMemPool::accept() : not enough fees %s, %"PRI64d" < %"PRI64d,
+                     hash.ToString().c_str(),
+                     nFees, txMinFee);
+
+    // Turn a free transaction away before its scripts are checked if the
+    // rate limiter is full already
+    if (fLimitFree && nFees < CTransaction::nMinRelayTxFee)
+    {
+        if (!RateLimitFree(nSize, false))
+            return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
+        fFree = true;
+    }
+
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, pvChecks))
+        return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
+
+    return true;
+}
+
+bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
+                        bool* pfMissingInputs)
+{
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    if (!CheckLooseTransaction(state, tx))
+        return false;
 
+    // is it already in the memory pool?
+    uint256 hash = tx.GetHash();
+    {
+        LOCK(cs);
+        if (mapTx.count(hash))
+            return false;
+    }
+
+    CTransaction* ptxOld = NULL;
+    if (!CheckConflicts(tx, ptxOld))
+        return false;
+
+    bool fFree = false;
     if (fCheckInputs)
     {
         CCoinsView dummy;
@@ -736,7 +1361,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         // do all inputs exist?
         // Note that this does not check for the presence of actual outputs (see the next check for that),
         // only helps filling in pfMissingInputs (to determine missing vs spent).
-        BOOST_FOREACH(const CTxIn txin, tx.vin) {
+        BOOST_FOREACH(const CTxIn txin, tx.GetVin()) {
             if (!view.HaveCoins(txin.prevout.hash)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
@@ -744,10 +1369,6 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
             }
         }
 
-        // are the actual inputs available?
-        if (!tx.HaveInputs(view))
-            return state.Invalid(error("CTxMemPool::accept() : inputs already spent"));
-
         // Bring the best block into scope
         view.GetBestBlock();
 
@@ -755,64 +1376,52 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         view.SetBackend(dummy);
         }
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (!tx.AreInputsStandard(view) && !fTestNet)
-            return error("CTxMemPool::accept() : nonstandard transaction input");
-
-        // Note: if you modify this code to accept non-standard transactions, then
-        // you should add code here to check that the transaction does a
-        // reasonable number of ECDSA signature verifications.
-
-        int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
-        // Don't accept it if it can't get into a block
-        int64 txMinFee = tx.GetMinFee(1000, true, GMF_RELAY);
-        if (fLimitFree && nFees < txMinFee)
-            return error("CTxMemPool::accept() : not enough fees %s, %"PRI64d" < %"PRI64d,
-                         hash.ToString().c_str(),
-                         nFees, txMinFee);
-
-        // Continuously rate-limit free transactions
-        // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-        // be annoying or make others' transactions take longer to confirm.
-        if (fLimitFree && nFees < CTransaction::nMinRelayTxFee)
-        {
-            static double dFreeCount;
-            static int64 nLastTime;
-            int64 nNow = GetTime();
-
-            LOCK(cs);
-
-            // Use an exponentially decaying ~10-minute window:
-            dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
-            nLastTime = nNow;
-            // -limitfreerelay unit is thousand-bytes-per-minute
-            // At default rate it would take over a month to fill 1GB
-            if (dFreeCount >= GetArg("-limitfreerelay", 15)*10*1000)
-                return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
-            if (fDebug)
-                printf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
-            dFreeCount += nSize;
-        }
-
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        // The scripts of several inputs are spread over the script check
+        // threads, like in ConnectBlock.
+        std::vector<CScriptCheck> vChecks;
+        bool fParallel = nScriptCheckThreads > 0 && tx.GetVin().size() > 1;
+        if (!CheckPoolInputs(state, tx, hash, view, fLimitFree, fFree, fParallel ? &vChecks : NULL))
+            return false;
+        if (fParallel)
         {
-            return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            control.Add(vChecks);
+            if (!control.Wait())
+            {
+                // Check again one by one, which tells non-canonical
+                // encodings apart from invalid signatures for the DoS score
+                tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC);
+                return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
+            }
         }
     }
 
     // Store transaction in memory
     {
         LOCK(cs);
+        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        // Local transactions (from the wallet or sendrawtransaction, or
+        // coming back after a reorg) are not held to the package limits
+        if (fLimitFree && !CheckPackageLimits(tx, nSize))
+            return state.Invalid(error("CTxMemPool::accept() : %s has too many unconfirmed ancestors or descendants",
+                                       hash.ToString().c_str()));
+        if (fFree && !RateLimitFree(nSize, true))
+            return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
         if (ptxOld)
         {
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
         addUnchecked(hash, tx);
+
+        // Make room, which may mean this one does not stay
+        if (nTotalUsage > nMaxMempoolUsage)
+        {
+            TrimToSize(nMaxMempoolUsage);
+            if (!mapTx.count(hash))
+                return state.Invalid(error("CTxMemPool::accept() : mempool full, fee rate of %s too low",
+                                           hash.ToString().c_str()));
+        }
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -824,28 +1433,526 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     return true;
 }
 
+// Whether tx spends an output of any of setHash
+static bool SpendsAnyOf(const CTransaction &tx, const std::set<uint256> &setHash)
+{
+    if (setHash.empty())
+        return false;
+    BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
+        if (setHash.count(txin.prevout.hash))
+            return true;
+    return false;
+}
+
+void CTxMemPool::acceptBatch(std::vector<CTransaction> &vtx, bool fLimitFree, std::vector<CValidationState> &vState,
+                             std::vector<bool> &vAccepted, std::vector<bool> &vMissingInputs)
+{
+    unsigned int nTx = vtx.size();
+    vState.assign(nTx, CValidationState());
+    vAccepted.assign(nTx, false);
+    vMissingInputs.assign(nTx, false);
+
+    // A lone transaction gains nothing from the batch; accept() only hands
+    // the scripts of several inputs to the check threads
+    if (nTx == 1)
+    {
+        bool fMissingInputs = false;
+        vAccepted[0] = accept(vState[0], vtx[0], true, fLimitFree, &fMissingInputs);
+        vMissingInputs[0] = fMissingInputs;
+        return;
+    }
+
+    // Checks that need neither inputs nor scripts; gather what the
+    // remaining transactions spend
+    std::vector<uint256> vHash(nTx);
+    std::vector<bool> vPassed(nTx, false);
+    std::set<uint256> setFetch;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        const CTransaction &tx = vtx[i];
+        vHash[i] = tx.GetHash();
+        if (!CheckLooseTransaction(vState[i], tx))
+            continue;
+        {
+            LOCK(cs);
+            if (mapTx.count(vHash[i]))
+                continue;
+        }
+        // Replacement is disabled, so any conflict rules the transaction out
+        CTransaction* ptxOld = NULL;
+        if (!CheckConflicts(tx, ptxOld) || ptxOld)
+            continue;
+        vPassed[i] = true;
+        setFetch.insert(vHash[i]);
+        BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
+            setFetch.insert(txin.prevout.hash);
+    }
+
+    // One pass over the coins for the whole batch: the inputs shared by
+    // several transactions are looked up once
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+    {
+        LOCK(cs);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+        view.SetBackend(viewMemPool);
+        BOOST_FOREACH(const uint256& hash, setFetch)
+            view.HaveCoins(hash);
+        view.GetBestBlock();
+        view.SetBackend(dummy);
+    }
+
+    // Check each transaction against the cached inputs, in order. Those that
+    // pass are spent in the view, so later ones in the batch can use their
+    // outputs and double spends within the batch are caught.
+    bool fParallel = nScriptCheckThreads > 0;
+    std::vector<CScriptCheck> vChecks;
+    std::vector<unsigned int> vCheckBegin(nTx + 1, 0);
+    std::vector<bool> vFree(nTx, false);
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        vCheckBegin[i] = vCheckBegin[i + 1] = vChecks.size();
+        if (!vPassed[i])
+            continue;
+        const CTransaction &tx = vtx[i];
+        vPassed[i] = false;
+
+        // do we already have it?
+        if (view.HaveCoins(vHash[i]))
+            continue;
+
+        bool fMissing = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
+            if (!view.HaveCoins(txin.prevout.hash))
+                fMissing = true;
+        if (fMissing) {
+            vMissingInputs[i] = true;
+            continue;
+        }
+
+        bool fFree = false;
+        if (!CheckPoolInputs(vState[i], tx, vHash[i], view, fLimitFree, fFree, fParallel ? &vChecks : NULL))
+            continue;
+        vFree[i] = fFree;
+        vCheckBegin[i + 1] = vChecks.size();
+
+        CTxUndo undoDummy;
+        tx.UpdateCoins(vState[i], view, undoDummy, MEMPOOL_HEIGHT, vHash[i]);
+        vPassed[i] = true;
+    }
+
+    // Verify the scripts of the whole batch in one go. Should any of them
+    // fail, run each transaction's own checks again to find out which; the
+    // queue consumes the checks, so they are kept aside for that.
+    std::set<uint256> setDropped;
+    if (fParallel)
+    {
+        std::vector<CScriptCheck> vChecksKept(vChecks);
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        if (!control.Wait())
+        {
+            printf("CTxMemPool::acceptBatch() : script check failed, checking %u transactions one by one\n", nTx);
+            for (unsigned int i = 0; i < nTx; i++)
+            {
+                if (!vPassed[i] || SpendsAnyOf(vtx[i], setDropped))
+                    continue;
+                for (unsigned int j = vCheckBegin[i]; j < vCheckBegin[i + 1]; j++)
+                {
+                    CScriptCheck &check = vChecksKept[j];
+                    if (check())
+                        continue;
+                    // Tell non-canonical encodings apart from invalid
+                    // signatures for the DoS score, like CheckInputs
+                    check.ClearFlags(SCRIPT_VERIFY_STRICTENC);
+                    if (check())
+                        vState[i].Invalid();
+                    else
+                        vState[i].DoS(100, false);
+                    error("CTxMemPool::acceptBatch() : ConnectInputs failed %s", vHash[i].ToString().c_str());
+                    vPassed[i] = false;
+                    setDropped.insert(vHash[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Store the transactions in memory, parents first. Those spending one
+    // that was turned away wait as orphans.
+    {
+        LOCK(cs);
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            if (!vPassed[i])
+                continue;
+            if (SpendsAnyOf(vtx[i], setDropped))
+            {
+                vPassed[i] = false;
+                vMissingInputs[i] = true;
+                setDropped.insert(vHash[i]);
+                continue;
+            }
+            unsigned int nSize = ::GetSerializeSize(vtx[i], SER_NETWORK, PROTOCOL_VERSION);
+            if (fLimitFree && !CheckPackageLimits(vtx[i], nSize))
+            {
+                vState[i].Invalid(error("CTxMemPool::acceptBatch() : %s has too many unconfirmed ancestors or descendants",
+                                        vHash[i].ToString().c_str()));
+                vPassed[i] = false;
+                setDropped.insert(vHash[i]);
+                continue;
+            }
+            if (vFree[i] && !RateLimitFree(nSize, true))
+            {
+                error("CTxMemPool::acceptBatch() : free transaction rejected by rate limiter");
+                vPassed[i] = false;
+                setDropped.insert(vHash[i]);
+                continue;
+            }
+            addUnchecked(vHash[i], vtx[i]);
+        }
+
+        // Make room, which may mean some of these do not stay
+        if (nTotalUsage > nMaxMempoolUsage)
+            TrimToSize(nMaxMempoolUsage);
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            if (!vPassed[i])
+                continue;
+            if (mapTx.count(vHash[i]))
+                vAccepted[i] = true;
+            else
+                vState[i].Invalid(error("CTxMemPool::acceptBatch() : mempool full, fee rate of %s too low",
+                                        vHash[i].ToString().c_str()));
+        }
+    }
+
+    for (unsigned int i = 0; i < nTx; i++)
+        if (vAccepted[i])
+            SyncWithWallets(vHash[i], vtx[i], NULL, true);
+}
+
 bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs)
 {
     try {
-        return mempool.accept(state, *this, fCheckInputs, fLimitFree, pfMissingInputs);
+        int64 nStart = GetTimeMicros();
+        bool fAccepted = mempool.accept(state, *this, fCheckInputs, fLimitFree, pfMissingInputs);
+        mempool.RecordAcceptTime(GetTimeMicros() - nStart);
+        return fAccepted;
     } catch(std::runtime_error &e) {
         return state.Abort(_("System error: ") + e.what());
     }
 }
 
+void CTxMemPool::RecordAcceptTime(int64 nMicros)
+{
+    LOCK(cs);
+    unsigned int nBucket = 0;
+    for (int64 nBound = 100; nBucket < ACCEPT_TIME_BUCKETS - 1 && nMicros >= nBound; nBound *= 10)
+        nBucket++;
+    nAcceptTime[nBucket]++;
+}
+
+// Heap space malloc takes for an allocation of n bytes, with its header and alignment
+static inline size_t MallocUsage(size_t n)
+{
+    if (n == 0)
+        return 0;
+    return ((n + sizeof(void*) + 15) >> 4) << 4;
+}
+
+// Approximate memory held for a pool transaction: its nodes in mapTx, mapEntry,
+// setByAncestorFee and mapNextTx, plus the inputs, outputs and scripts
+static size_t MemPoolTxUsage(const CTransaction &tx)
+{
+    // tree nodes carry three pointers and a colour ahead of the value
+    static const size_t nNodeHeader = 4 * sizeof(void*);
+    size_t nUsage = MallocUsage(nNodeHeader + sizeof(std::map<uint256, CTransaction>::value_type));
+    nUsage += MallocUsage(nNodeHeader + sizeof(std::map<uint256, CTxMemPoolEntry>::value_type));
+    nUsage += MallocUsage(nNodeHeader + sizeof(CTxMemPoolEntry*));
+    nUsage += tx.GetVin().size() * MallocUsage(nNodeHeader + sizeof(std::map<COutPoint, CInPoint>::value_type));
+    nUsage += MallocUsage(tx.GetVin().capacity() * sizeof(CTxIn)) + MallocUsage(tx.GetVout().capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
+        nUsage += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH(const CTxOut& txout, tx.GetVout())
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+    return nUsage;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
         mapTx[hash] = tx;
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        for (unsigned int i = 0; i < tx.GetVin().size(); i++)
+            mapNextTx[tx.GetVin()[i].prevout] = CInPoint(&mapTx[hash], i);
+
+        // Work out fee and priority once, rather than on every block template
+        map<uint256, CTxMemPoolEntry>::iterator miOld = mapEntry.find(hash);
+        if (miOld != mapEntry.end())
+        {
+            nTotalUsage -= miOld->second.nUsage;
+            nTotalTxSize -= miOld->second.nTxSize;
+            setByAncestorFee.erase(&miOld->second);
+            setByDescendantScore.erase(&miOld->second);
+            mapEntry.erase(miOld);
+        }
+        CTxMemPoolEntry &entry = mapEntry[hash];
+        entry.hash = hash;
+        entry.ptx = &mapTx[hash];
+        entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        entry.nUsage = MemPoolTxUsage(*entry.ptx);
+        nTotalUsage += entry.nUsage;
+        nTotalTxSize += entry.nTxSize;
+        entry.nSigOps = tx.GetLegacySigOpCount();
+        entry.nHeight = nBestHeight;
+        int64 nValueIn = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
+        {
+            map<uint256, CTransaction>::iterator mi = mapTx.find(txin.prevout.hash);
+            if (mi != mapTx.end())
+            {
+                if (txin.prevout.n < mi->second.GetVout().size())
+                    nValueIn += mi->second.GetVout()[txin.prevout.n].nValue;
+                continue;
+            }
+            if (!pcoinsTip || !pcoinsTip->HaveCoins(txin.prevout.hash))
+                continue;
+            const CCoins &coins = pcoinsTip->AccessCoins(txin.prevout.hash);
+            if (!coins.IsAvailable(txin.prevout.n))
+                continue;
+            int64 nValue = coins.vout[txin.prevout.n].nValue;
+            nValueIn += nValue;
+            entry.nValueInChain += nValue;
+            entry.dPriority += (double)nValue * (nBestHeight - coins.nHeight + 1);
+        }
+        entry.dPriority /= entry.nTxSize;
+        entry.nFee = std::max(nValueIn - tx.GetValueOut(), (int64)0);
+        std::set<uint256> setAncestors;
+        CalculateAncestors(tx, setAncestors);
+        UpdateAncestorState(entry, setAncestors);
+        setByAncestorFee.insert(&entry);
+
+        // A transaction coming back after a reorg may already have children here
+        std::set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        UpdateDescendantState(entry, setDescendants);
+        setByDescendantScore.insert(&entry);
+        if (setDescendants.empty())
+        {
+            // Nothing spends it yet, so its ancestors only gain it as a descendant
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+                UpdateDescendantTotals(hashAncestor, entry.nFee, entry.nTxSize, 1);
+        }
+        else
+        {
+            // Its ancestors and descendants may already be linked some other
+            // way, so their totals are redone. This only happens for a
+            // transaction returning to the pool after a reorg
+            UpdateAncestors(setAncestors);
+            UpdateDescendants(setDescendants);
+        }
         nTransactionsUpdated++;
     }
+    uiInterface.NotifyMempoolChanged();
     return true;
 }
 
+void CTxMemPool::CalculateAncestors(const CTransaction &tx, std::set<uint256> &setAncestors)
+{
+    std::vector<const CTransaction*> vQueue(1, &tx);
+    while (!vQueue.empty())
+    {
+        const CTransaction *ptx = vQueue.back();
+        vQueue.pop_back();
+        BOOST_FOREACH(const CTxIn& txin, ptx->GetVin())
+        {
+            map<uint256, CTransaction>::iterator mi = mapTx.find(txin.prevout.hash);
+            if (mi != mapTx.end() && setAncestors.insert(txin.prevout.hash).second)
+                vQueue.push_back(&mi->second);
+        }
+    }
+}
+
+// The entry must not be in setByAncestorFee while this runs
+void CTxMemPool::UpdateAncestorState(CTxMemPoolEntry &entry, const std::set<uint256> &setAncestors)
+{
+    entry.nFeesWithAncestors = entry.nFee;
+    entry.nSizeWithAncestors = entry.nTxSize;
+    entry.nCountWithAncestors = 1;
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashAncestor);
+        if (mi == mapEntry.end())
+            continue;
+        entry.nFeesWithAncestors += mi->second.nFee;
+        entry.nSizeWithAncestors += mi->second.nTxSize;
+        entry.nCountWithAncestors++;
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256 &hash, std::set<uint256> &setDescendants)
+{
+    std::vector<uint256> vQueue(1, hash);
+    while (!vQueue.empty())
+    {
+        uint256 hashParent = vQueue.back();
+        vQueue.pop_back();
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashParent, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hashParent; it++)
+        {
+            uint256 hashChild = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vQueue.push_back(hashChild);
+        }
+    }
+}
+
+// Redo the ancestor totals of setDescendants in full
+void CTxMemPool::UpdateDescendants(const std::set<uint256> &setDescendants)
+{
+    BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashDescendant);
+        if (mi == mapEntry.end())
+            continue;
+        std::set<uint256> setAncestors;
+        CalculateAncestors(*mi->second.ptx, setAncestors);
+        setByAncestorFee.erase(&mi->second);
+        UpdateAncestorState(mi->second, setAncestors);
+        setByAncestorFee.insert(&mi->second);
+    }
+}
+
+// The entry must not be in setByDescendantScore while this runs
+void CTxMemPool::UpdateDescendantState(CTxMemPoolEntry &entry, const std::set<uint256> &setDescendants)
+{
+    entry.nFeesWithDescendants = entry.nFee;
+    entry.nSizeWithDescendants = entry.nTxSize;
+    entry.nCountWithDescendants = 1;
+    BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashDescendant);
+        if (mi == mapEntry.end())
+            continue;
+        entry.nFeesWithDescendants += mi->second.nFee;
+        entry.nSizeWithDescendants += mi->second.nTxSize;
+        entry.nCountWithDescendants++;
+    }
+}
+
+// Redo the descendant totals of setAncestors in full
+void CTxMemPool::UpdateAncestors(const std::set<uint256> &setAncestors)
+{
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashAncestor);
+        if (mi == mapEntry.end())
+            continue;
+        std::set<uint256> setDescendants;
+        CalculateDescendants(hashAncestor, setDescendants);
+        setByDescendantScore.erase(&mi->second);
+        UpdateDescendantState(mi->second, setDescendants);
+        setByDescendantScore.insert(&mi->second);
+    }
+}
+
+// Add one transaction's fee, size and count to the ancestor totals of the
+// entry for hash; negative values take it out again
+void CTxMemPool::UpdateAncestorTotals(const uint256 &hash, int64 nFee, int64 nSize, int nCount)
+{
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    CTxMemPoolEntry &entry = mi->second;
+    setByAncestorFee.erase(&entry);
+    entry.nFeesWithAncestors += nFee;
+    entry.nSizeWithAncestors += nSize;
+    entry.nCountWithAncestors += nCount;
+    setByAncestorFee.insert(&entry);
+}
+
+// The same for the descendant totals
+void CTxMemPool::UpdateDescendantTotals(const uint256 &hash, int64 nFee, int64 nSize, int nCount)
+{
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    CTxMemPoolEntry &entry = mi->second;
+    setByDescendantScore.erase(&entry);
+    entry.nFeesWithDescendants += nFee;
+    entry.nSizeWithDescendants += nSize;
+    entry.nCountWithDescendants += nCount;
+    setByDescendantScore.insert(&entry);
+}
+
+// Whether tx, with its ancestors in the pool, and each of those ancestors,
+// with their descendants, stay within the package limits once it is added.
+// This bounds the ancestor and descendant walks done for each pool entry.
+bool CTxMemPool::CheckPackageLimits(const CTransaction &tx, unsigned int nSize)
+{
+    std::set<uint256> setAncestors;
+    CalculateAncestors(tx, setAncestors);
+    if (setAncestors.size() + 1 > nMempoolAncestorLimit)
+        return false;
+    uint64 nSizeWithAncestors = nSize;
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashAncestor);
+        if (mi == mapEntry.end())
+            continue;
+        const CTxMemPoolEntry &entry = mi->second;
+        nSizeWithAncestors += entry.nTxSize;
+        if (entry.nCountWithDescendants + 1 > nMempoolAncestorLimit ||
+            entry.nSizeWithDescendants + nSize > nMempoolAncestorSizeLimit)
+            return false;
+    }
+    return nSizeWithAncestors <= nMempoolAncestorSizeLimit;
+}
+
+// The outputs of hash, now in a block, start aging for the children spending them
+void CTxMemPool::UpdateChildPriority(const uint256 &hash)
+{
+    if (!pcoinsTip || !pcoinsTip->HaveCoins(hash))
+        return;
+    const CCoins &coins = pcoinsTip->AccessCoins(hash);
+    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+    for (; it != mapNextTx.end() && it->first.hash == hash; it++)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(it->second.ptx->GetHash());
+        if (mi == mapEntry.end() || !coins.IsAvailable(it->first.n))
+            continue;
+        CTxMemPoolEntry &entry = mi->second;
+        int64 nValue = coins.vout[it->first.n].nValue;
+        // dPriority stays relative to the height the child entered at, see GetPriority
+        entry.nValueInChain += nValue;
+        entry.dPriority += (double)nValue * ((int)entry.nHeight - (int)coins.nHeight + 1) / entry.nTxSize;
+    }
+}
+
+void CTxMemPool::GetSortedAncestors(const uint256 &hash, std::vector<const CTxMemPoolEntry*> &vAncestors)
+{
+    vAncestors.clear();
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    std::set<uint256> setAncestors;
+    CalculateAncestors(*mi->second.ptx, setAncestors);
+    std::vector<std::pair<unsigned int, const CTxMemPoolEntry*> > vSort;
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mia = mapEntry.find(hashAncestor);
+        if (mia != mapEntry.end())
+            vSort.push_back(std::make_pair(mia->second.nCountWithAncestors, &mia->second));
+    }
+    // A transaction has more ancestors than any of its ancestors do
+    std::sort(vSort.begin(), vSort.end());
+    for (unsigned int i = 0; i < vSort.size(); i++)
+        vAncestors.push_back(vSort[i].second);
+}
+
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -853,20 +1960,61 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (fRecursive) {
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                if (it != mapNextTx.end())
-                    remove(*it->second.ptx, true);
+        // With fRecursive everything spending it goes too, found in one walk
+        std::set<uint256> setRemove;
+        if (fRecursive)
+            CalculateDescendants(hash, setRemove);
+        if (mapTx.count(hash))
+            setRemove.insert(hash);
+        if (setRemove.empty())
+            return true;
+
+        // Take each one out of the totals of what stays: its ancestors outside
+        // the package, and the children left behind when it alone went into a
+        // block. This needs the links, so it comes before anything is erased.
+        BOOST_FOREACH(const uint256 &hashRemove, setRemove)
+        {
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashRemove);
+            if (mi == mapEntry.end())
+                continue;
+            const CTxMemPoolEntry &entry = mi->second;
+            std::set<uint256> setAncestors;
+            CalculateAncestors(*entry.ptx, setAncestors);
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+                if (!setRemove.count(hashAncestor))
+                    UpdateDescendantTotals(hashAncestor, -entry.nFee, -(int64)entry.nTxSize, -1);
+            if (!fRecursive)
+            {
+                std::set<uint256> setDescendants;
+                CalculateDescendants(hashRemove, setDescendants);
+                BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+                    UpdateAncestorTotals(hashDescendant, -entry.nFee, -(int64)entry.nTxSize, -1);
             }
         }
-        if (mapTx.count(hash))
+
+        // tx may live in mapTx, so it is not used past here
+        BOOST_FOREACH(const uint256 &hashRemove, setRemove)
         {
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            map<uint256, CTransaction>::iterator mit = mapTx.find(hashRemove);
+            if (mit == mapTx.end())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, mit->second.GetVin())
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashRemove);
+            if (mi != mapEntry.end())
+            {
+                nTotalUsage -= mi->second.nUsage;
+                nTotalTxSize -= mi->second.nTxSize;
+                setByAncestorFee.erase(&mi->second);
+                setByDescendantScore.erase(&mi->second);
+                mapEntry.erase(mi);
+            }
+            mapTx.erase(mit);
         }
+        // The children left behind gain confirmed inputs
+        if (!fRecursive)
+            UpdateChildPriority(hash);
+        nTransactionsUpdated++;
     }
     return true;
 }
@@ -875,7 +2023,7 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
 {
     // Remove transactions which depend on inputs of tx, recursively
     LOCK(cs);
-    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+    BOOST_FOREACH(const CTxIn &txin, tx.GetVin()) {
         std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
@@ -891,9 +2039,33 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setByAncestorFee.clear();
+    setByDescendantScore.clear();
+    nTotalUsage = 0;
+    nTotalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
+void CTxMemPool::TrimToSize(size_t nLimit)
+{
+    LOCK(cs);
+    while (nTotalUsage > nLimit && !setByDescendantScore.empty())
+    {
+        // The lowest fee rate goes first, unless its descendants pay for
+        // it; whatever spends it cannot stay without it and goes along in
+        // the same remove().
+        CTxMemPoolEntry *pentry = *setByDescendantScore.rbegin();
+        size_t nUsageBefore = nTotalUsage;
+        unsigned int nCountBefore = mapTx.size();
+        if (fDebug)
+            printf("CTxMemPool::TrimToSize() : evicting %s\n", pentry->hash.ToString().c_str());
+        remove(*pentry->ptx, true);
+        nEvicted += nCountBefore - mapTx.size();
+        nEvictedBytes += nUsageBefore - nTotalUsage;
+    }
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -913,7 +2085,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -987,11 +2159,13 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                CBlockFileStream file(SER_DISK, CLIENT_VERSION);
+                if (!OpenBlockFileRecord(postx, "blk", 0, file))
+                    return error("%s() : OpenBlockFileRecord failed", __PRETTY_FUNCTION__);
                 CBlockHeader header;
                 try {
                     file >> header;
-                    fseek(file, postx.nTxOffset, SEEK_CUR);
+                    file.ignore(postx.nTxOffset);
                     file >> txOut;
                 } catch (std::exception &e) {
                     return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1042,22 +2216,58 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Turn the lowest '1' bit in the binary representation of a number into a '0'
+int static inline InvertLowestOne(int n) { return n & (n - 1); }
+
+// Height to jump back to with the pskip pointer. Any height strictly lower
+// than the given one would do; this choice keeps walks from any height to
+// any ancestor short (about 110 steps for 2^18 blocks).
+int static inline GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 && heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
@@ -1069,6 +2279,17 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CBlockFileStream &ssBlock, const CBlockIndex* pindex)
+{
+    if (!OpenBlockFileRecord(pindex->GetBlockPos(), "blk", 0, ssBlock))
+        return error("ReadRawBlockFromDisk() : OpenBlockFileRecord failed");
+
+    // The header hash costs one compression; the transactions are left alone
+    if (ssBlock.size() < 80 || Hashblake(ssBlock.begin(), ssBlock.begin() + 80) != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk() : header doesn't match index");
+    return true;
+}
+
 uint256 static GetOrphanRoot(const CBlockHeader* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -1169,9 +2390,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
     }
 
     // Go back by what we want to be nInterval blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < nInterval-1; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - (nInterval-1));
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1279,7 +2498,7 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
     }
 }
 
-bool ConnectBestBlock(CValidationState &state) {
+bool ConnectBestBlock(CValidationState &state, CBlock *pblock) {
     do {
         CBlockIndex *pindexNewBest;
 
@@ -1318,7 +2537,7 @@ bool ConnectBestBlock(CValidationState &state) {
                 BOOST_FOREACH(CBlockIndex *pindexSwitch, vAttach) {
                     boost::this_thread::interruption_point();
                     try {
-                        if (!SetBestChain(state, pindexSwitch))
+                        if (!SetBestChain(state, pindexSwitch, pblock))
                             return false;
                     } catch(std::runtime_error &e) {
                         return state.Abort(_("System error: ") + e.what());
@@ -1352,7 +2571,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1396,8 +2615,9 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
         }
     }
 
-    // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    // add outputs; only a coinbase can repeat the txid of one still unspent,
+    // as BIP30 is not enforced on connected blocks
+    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight), !IsCoinBase()));
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1413,7 +2633,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1422,7 +2642,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 }
 
 bool CScriptCheck::operator()() const {
-    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    const CScript &scriptSig = ptxTo->GetVin()[nIn].scriptSig;
     if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
@@ -1453,7 +2673,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1489,7 +2709,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         if (fScriptChecks) {
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
                 CScriptCheck check(coins, *this, i, flags, 0);
@@ -1562,10 +2782,10 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
         // restore inputs
         if (i > 0) { // not coinbases
             const CTxUndo &txundo = blockUndo.vtxundo[i-1];
-            if (txundo.vprevout.size() != tx.vin.size())
+            if (txundo.vprevout.size() != tx.GetVin().size())
                 return error("DisconnectBlock() : transaction and undo data inconsistent");
-            for (unsigned int j = tx.vin.size(); j-- > 0;) {
-                const COutPoint &out = tx.vin[j].prevout;
+            for (unsigned int j = tx.GetVin().size(); j-- > 0;) {
+                const COutPoint &out = tx.GetVin()[j].prevout;
                 const CTxInUndo &undo = txundo.vprevout[j];
                 CCoins coins;
                 view.GetCoins(out.hash, coins); // this can fail if the prevout was already entirely spent
@@ -1609,6 +2829,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // A truncated file must not stay mapped beyond its new end
+    if (fFinalize)
+        CloseBlockFileMappings(nLastBlockFile);
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -1628,19 +2852,21 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, bool fChecked)
 {
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
+    if (!fChecked && !CheckBlock(state, !fJustCheck, !fJustCheck))
         return false;
 
+    // Pull in the coins read ahead of time for this block
+    if (!fJustCheck)
+        FinishCoinsPrefetch(GetHash());
+
     // verify that the view's current state corresponds to the previous block
     assert(pindex->pprev == view.GetBestBlock());
 
@@ -1673,7 +2899,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -1700,7 +2926,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     {
         const CTransaction &tx = vtx[i];
 
-        nInputs += tx.vin.size();
+        nInputs += tx.GetVin().size();
         nSigOps += tx.GetLegacySigOpCount();
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return state.DoS(100, error("ConnectBlock() : too many sigops"));
@@ -1788,7 +3014,36 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     return true;
 }
 
-bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
+// Connection times of the blocks connected during the last minute (protected by cs_main)
+static std::deque<int64> dequeConnectTimes;
+static uint64 nBlocksConnected = 0;
+static int64 nFirstConnectTime = 0;
+
+static void RecordBlocksConnected(unsigned int nBlocks)
+{
+    int64 nNow = GetTimeMillis();
+    if (nBlocksConnected == 0)
+        nFirstConnectTime = nNow;
+    nBlocksConnected += nBlocks;
+    for (unsigned int i = 0; i < nBlocks; i++)
+        dequeConnectTimes.push_back(nNow);
+    while (!dequeConnectTimes.empty() && dequeConnectTimes.front() < nNow - 60000)
+        dequeConnectTimes.pop_front();
+}
+
+void GetBlockConnectRate(uint64 &nBlocks, double &dRecent, double &dOverall)
+{
+    int64 nNow = GetTimeMillis();
+    while (!dequeConnectTimes.empty() && dequeConnectTimes.front() < nNow - 60000)
+        dequeConnectTimes.pop_front();
+    nBlocks = nBlocksConnected;
+    dRecent = dequeConnectTimes.size() / 60.0;
+    dOverall = 0;
+    if (nBlocksConnected > 0 && nNow > nFirstConnectTime)
+        dOverall = nBlocksConnected * 1000.0 / (nNow - nFirstConnectTime);
+}
+
+bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew, CBlock *pblockNew)
 {
     // All modifications to the coin state will be done in this cache.
     // Only when all have succeeded, we push it to pcoinsTip.
@@ -1848,11 +3103,17 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // Connect longer branch
     vector<CTransaction> vDelete;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return state.Abort(_("Failed to read block"));
+        // The block that was just accepted is still in memory, and already checked
+        CBlock blockRead;
+        CBlock *pblock = pblockNew;
+        if (pblock == NULL || pblock->GetHash() != pindex->GetBlockHash()) {
+            if (!blockRead.ReadFromDisk(pindex))
+                return state.Abort(_("Failed to read block"));
+            pblock = &blockRead;
+        }
+        CBlock &block = *pblock;
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        if (!block.ConnectBlock(state, pindex, view, false, pblock == pblockNew)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -1866,6 +3127,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             vDelete.push_back(tx);
     }
+    RecordBlocksConnected(vConnect.size());
 
     // Flush changes to global coin state
     int64 nStart = GetTimeMicros();
@@ -1875,9 +3137,13 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     if (fBenchmark)
         printf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified, 0.001 * nTime, 0.001 * nTime / nModified);
 
-    // Make sure it's successfully written to disk before changing memory structure
+    // Hand modified coins to the flush thread. Block and undo files are synced
+    // first, so the coin database never refers to data that is not on disk;
+    // a failed background write is reported by the next call.
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    CCoinsFlushStats statsFlush;
+    GetCoinsFlushStats(statsFlush);
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() + statsFlush.nPendingBytes > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -1887,7 +3153,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
             return state.Error();
         FlushBlockFile();
         pblocktree->Sync();
-        if (!pcoinsTip->Flush())
+        if (!FlushCoinsTip(true))
             return state.Abort(_("Failed to write to coin database"));
     }
 
@@ -1904,6 +3170,11 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
 
+    // Update the height index of the active chain
+    vBlockIndexByHeight.resize(pindexNew->nHeight + 1);
+    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
+
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect) {
         // ignore validation errors in resurrected transactions
@@ -1928,7 +3199,6 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = pindexNew->GetBlockHash();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
@@ -1976,15 +3246,16 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
+    CBlockIndex* pindexNew = poolBlockIndex.New(*this);
     assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->nTx = vtx.size();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
@@ -1999,7 +3270,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Abort(_("Failed to write block index"));
 
     // New best?
-    if (!ConnectBestBlock(state))
+    if (!ConnectBestBlock(state, this))
         return false;
 
     if (pindexNew == pindexBest)
@@ -2118,6 +3389,8 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    uint256 hash = GetHash();
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"));
@@ -2142,7 +3415,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     }
 */
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(GetHash(), nBits))
+    if (fCheckPOW && !CheckProofOfWork(hash, nBits))
         return state.DoS(50, error("CheckBlock() : proof of work failed"));
 
     // Check timestamp
@@ -2164,7 +3437,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     // Build the merkle tree already. We need it anyway later, and it makes the
     // block cache the transaction hashes, which means they don't need to be
     // recalculated many times during this block's validation.
-    BuildMerkleTree();
+    uint256 hashMerkleRootBuilt = BuildMerkleTree();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2184,7 +3457,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
@@ -2201,7 +3474,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != hashGenesisBlock) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"));
         pindexPrev = (*mi).second;
@@ -2245,8 +3518,8 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
                 (fTestNet && CBlockIndex::IsSuperMajority(2, pindexPrev, 51, 100)))
             {
                 CScript expect = CScript() << nHeight;
-                if (vtx[0].vin[0].scriptSig.size() < expect.size() ||
-                    !std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin()))
+                if (vtx[0].GetVin()[0].scriptSig.size() < expect.size() ||
+                    !std::equal(expect.begin(), expect.end(), vtx[0].GetVin()[0].scriptSig.begin()))
                     return state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
             }
         }
@@ -2294,7 +3567,236 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+/** Runs the context-free checks of blocks (CheckBlock: sizes, transaction
+ *  sanity, Blake proof of work, merkle root) on worker threads, ahead of the
+ *  thread that accepts and connects them under cs_main. Blocks queued from
+ *  network messages are also deserialized by the workers.
+ */
+class CBlockPrecheckQueue
+{
+private:
+    struct CJob {
+        boost::shared_ptr<CBlock> pblock;
+        boost::shared_ptr<CDataStream> pssRaw; // message the block is read from, if any
+        bool fDone;
+        bool fOk;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+    boost::thread_group threads;
+    int nThreads;
+    bool fQuit;
+
+    std::map<uint256, CJob> mapJobs;
+    std::deque<uint256> queueTodo;  // jobs no worker has started yet
+    std::deque<uint256> queueOrder; // all jobs, oldest first (may hold taken ones)
+
+    CBlockPrecheckStats stats;
+
+    void Thread() {
+        RenameThread("bitcoin-precheck");
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            while (queueTodo.empty() && !fQuit)
+                condWorker.wait(lock);
+            if (fQuit)
+                return;
+            uint256 hash = queueTodo.front();
+            queueTodo.pop_front();
+            std::map<uint256, CJob>::iterator it = mapJobs.find(hash);
+            if (it == mapJobs.end())
+                continue;
+            // only finished jobs are evicted, so this one stays in mapJobs
+            boost::shared_ptr<CBlock> pblock = it->second.pblock;
+            boost::shared_ptr<CDataStream> pssRaw = it->second.pssRaw;
+            lock.unlock();
+            bool fOk = true;
+            if (!pblock) {
+                pblock.reset(new CBlock());
+                try {
+                    CDataStream ss(pssRaw->begin(), pssRaw->end(), pssRaw->GetType(), pssRaw->GetVersion());
+                    ss >> *pblock;
+                } catch (std::exception &e) {
+                    // the message is still validated and rejected the normal way later
+                    fOk = false;
+                }
+            }
+            CValidationState state;
+            fOk = fOk && pblock->CheckBlock(state);
+            lock.lock();
+            it = mapJobs.find(hash);
+            it->second.pblock = pblock;
+            it->second.fDone = true;
+            it->second.fOk = fOk;
+            stats.nChecked++;
+            if (!fOk)
+                stats.nFailed++;
+            condDone.notify_all();
+        }
+    }
+
+    // Make room for one job by dropping the oldest finished one. Requires lock.
+    bool MakeRoom() {
+        if (mapJobs.size() < MAX_BLOCK_PRECHECK_QUEUE)
+            return true;
+        for (std::deque<uint256>::iterator it = queueOrder.begin(); it != queueOrder.end(); ) {
+            std::map<uint256, CJob>::iterator mi = mapJobs.find(*it);
+            if (mi == mapJobs.end()) {
+                it = queueOrder.erase(it);
+                continue;
+            }
+            if (mi->second.fDone) {
+                mapJobs.erase(mi);
+                queueOrder.erase(it);
+                stats.nEvicted++;
+                return true;
+            }
+            it++;
+        }
+        return false;
+    }
+
+public:
+    CBlockPrecheckQueue() : nThreads(0), fQuit(false) {}
+
+    bool Contains(const uint256 &hash) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return mapJobs.count(hash) > 0;
+    }
+
+    // Queue a block, or the message to read it from, for checking; fails if
+    // it is already queued or the queue is full
+    bool Push(const uint256 &hash, const boost::shared_ptr<CBlock> &pblock, const boost::shared_ptr<CDataStream> &pssRaw) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nBlockPrecheckThreads <= 0 || mapJobs.count(hash) || !MakeRoom())
+            return false;
+        while (nThreads < nBlockPrecheckThreads) {
+            threads.create_thread(boost::bind(&CBlockPrecheckQueue::Thread, this));
+            nThreads++;
+        }
+        CJob &job = mapJobs[hash];
+        job.pblock = pblock;
+        job.pssRaw = pssRaw;
+        job.fDone = false;
+        job.fOk = false;
+        queueTodo.push_back(hash);
+        queueOrder.push_back(hash);
+        condWorker.notify_one();
+        return true;
+    }
+
+    // Wait for the checks of a queued block and remove it from the queue.
+    // Returns NULL if hash was not queued. Callers hold cs_main; the workers
+    // never take it, so the wait is at most one block's checks.
+    boost::shared_ptr<CBlock> Take(const uint256 &hash, bool &fOk, boost::shared_ptr<CDataStream> *ppssRaw = NULL) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<uint256, CJob>::iterator it = mapJobs.find(hash);
+        if (it == mapJobs.end()) {
+            stats.nMisses++;
+            return boost::shared_ptr<CBlock>();
+        }
+        while (!it->second.fDone) {
+            condDone.wait(lock);
+            it = mapJobs.find(hash);
+            if (it == mapJobs.end()) {
+                stats.nMisses++;
+                return boost::shared_ptr<CBlock>();
+            }
+        }
+        boost::shared_ptr<CBlock> pblock = it->second.pblock;
+        fOk = it->second.fOk;
+        if (ppssRaw)
+            *ppssRaw = it->second.pssRaw;
+        mapJobs.erase(it);
+        stats.nHits++;
+        return pblock;
+    }
+
+    void GetStats(CBlockPrecheckStats &statsOut) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        statsOut = stats;
+        statsOut.nQueued = mapJobs.size();
+    }
+
+    void Stop() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+            condWorker.notify_all();
+        }
+        threads.join_all();
+        nThreads = 0;
+        mapJobs.clear();
+        queueTodo.clear();
+        queueOrder.clear();
+        fQuit = false;
+    }
+};
+
+static CBlockPrecheckQueue queueBlockPrecheck;
+
+static void PrecheckBlock(const boost::shared_ptr<CBlock> &pblock)
+{
+    queueBlockPrecheck.Push(pblock->GetHash(), pblock, boost::shared_ptr<CDataStream>());
+}
+
+static void PrecheckBlockMessage(CDataStream &vRecv, unsigned int nMessageSize)
+{
+    if (nBlockPrecheckThreads <= 0 || nMessageSize < 80 || vRecv.size() < nMessageSize)
+        return;
+    uint256 hash = Hashblake(vRecv.begin(), vRecv.begin() + 80);
+    if (queueBlockPrecheck.Contains(hash))
+        return;
+    // Only copy the bytes here; a worker deserializes them
+    boost::shared_ptr<CDataStream> pssRaw(new CDataStream(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.GetType(), vRecv.GetVersion()));
+    queueBlockPrecheck.Push(hash, boost::shared_ptr<CBlock>(), pssRaw);
+}
+
+// Return the block the precheck threads read from the same bytes as a
+// "block" message and validated, if its checks passed
+static boost::shared_ptr<CBlock> TakePrecheckedMessage(CDataStream &vRecv)
+{
+    if (vRecv.size() < 80)
+        return boost::shared_ptr<CBlock>();
+    bool fOk = false;
+    boost::shared_ptr<CDataStream> pssRaw;
+    boost::shared_ptr<CBlock> pchecked = queueBlockPrecheck.Take(Hashblake(vRecv.begin(), vRecv.begin() + 80), fOk, &pssRaw);
+    if (!pchecked || !fOk || !pssRaw || pssRaw->size() != vRecv.size() ||
+        !std::equal(vRecv.begin(), vRecv.end(), pssRaw->begin()))
+        return boost::shared_ptr<CBlock>();
+    return pchecked;
+}
+
+// Return the checked copy of block from the precheck queue, if its checks passed
+static CBlock *TakePrecheckedBlock(const CBlock &block, boost::shared_ptr<CBlock> &pchecked)
+{
+    bool fOk = false;
+    pchecked = queueBlockPrecheck.Take(block.GetHash(), fOk);
+    if (!pchecked || !fOk)
+        return NULL;
+    // The header hash commits to the merkle root but not to the exact transaction
+    // list (duplicated trailing transactions give the same root), so compare txids.
+    if (pchecked->vtx.size() != block.vtx.size())
+        return NULL;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        if (pchecked->vtx[i].GetHash() != block.vtx[i].GetHash())
+            return NULL;
+    return pchecked.get();
+}
+
+void GetBlockPrecheckStats(CBlockPrecheckStats &stats)
+{
+    queueBlockPrecheck.GetStats(stats);
+}
+
+void StopBlockPrecheckThreads()
+{
+    queueBlockPrecheck.Stop();
+}
+
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2303,8 +3805,8 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
-    // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    // Preliminary checks, unless the precheck threads did them on this very object
+    if (!fChecked && !pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -2344,6 +3846,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return true;
     }
 
+    // Read the coins it spends while the block is being stored
+    if (pblock->hashPrevBlock == hashBestChain)
+        StartCoinsPrefetch(*pblock);
+
     // Store to disk
     if (!pblock->AcceptBlock(state, dbp))
         return error("ProcessBlock() : AcceptBlock FAILED");
@@ -2361,6 +3867,8 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             CBlock* pblockOrphan = (*mi).second;
             // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
             CValidationState stateDummy;
+            if (pblockOrphan->hashPrevBlock == hashBestChain)
+                StartCoinsPrefetch(*pblockOrphan);
             if (pblockOrphan->AcceptBlock(stateDummy))
                 vWorkQueue.push_back(pblockOrphan->GetHash());
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
@@ -2588,14 +4096,12 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = poolBlockIndex.New();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -2610,6 +4116,7 @@ bool static LoadBlockIndexDB()
     boost::this_thread::interruption_point();
 
     // Calculate nChainWork
+    int64 nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -2621,11 +4128,13 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
+        pindex->BuildSkip();
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
     }
+    printf("LoadBlockIndexDB(): chain work computed in %"PRI64d"ms\n", GetTimeMillis() - nStart);
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -2655,11 +4164,14 @@ bool static LoadBlockIndexDB()
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexBest->nChainWork;
 
-    // set 'next' pointers in best chain
+    // set 'next' pointers and the height index of the best chain
+    vBlockIndexByHeight.resize(nBestHeight + 1);
+    vBlockIndexByHeight[nBestHeight] = pindexBest;
     CBlockIndex *pindex = pindexBest;
     while(pindex != NULL && pindex->pprev != NULL) {
          CBlockIndex *pindexPrev = pindex->pprev;
          pindexPrev->pnext = pindex;
+         vBlockIndexByHeight[pindexPrev->nHeight] = pindexPrev;
          pindex = pindexPrev;
     }
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
@@ -2709,7 +4221,7 @@ bool VerifyDB() {
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= 2 * nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2746,6 +4258,7 @@ bool VerifyDB() {
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
+    vBlockIndexByHeight.clear();
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
     nBestHeight = 0;
@@ -2796,11 +4309,11 @@ bool InitBlockIndex() {
         // Genesis block
         const char* pszTimestamp = "US forces target leading al-Shabaab militant in Somalian coastal raid";
         CTransaction txNew;
-        txNew.vin.resize(1);
-        txNew.vout.resize(1);
-        txNew.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4) << vector<unsigned char>((const unsigned char*)pszTimestamp, (const unsigned char*)pszTimestamp + strlen(pszTimestamp));
-        txNew.vout[0].nValue = nGenesisBlockRewardCoin;
-        txNew.vout[0].scriptPubKey = CScript() << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG;
+        txNew.MutableVin().resize(1);
+        txNew.MutableVout().resize(1);
+        txNew.MutableVin()[0].scriptSig = CScript() << 486604799 << CBigNum(4) << vector<unsigned char>((const unsigned char*)pszTimestamp, (const unsigned char*)pszTimestamp + strlen(pszTimestamp));
+        txNew.MutableVout()[0].nValue = nGenesisBlockRewardCoin;
+        txNew.MutableVout()[0].scriptPubKey = CScript() << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG;
         CBlock block;
         block.vtx.push_back(txNew);
         block.hashPrevBlock = 0;
@@ -2855,7 +4368,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2921,11 +4434,34 @@ void PrintBlockTree()
     }
 }
 
+// Process the oldest block read ahead by LoadExternalBlockFile. Returns false on a fatal error.
+static bool ProcessExternalBlock(std::deque<std::pair<uint64, boost::shared_ptr<CBlock> > > &queueRead, CDiskBlockPos *dbp, int &nLoaded)
+{
+    uint64 nBlockPos = queueRead.front().first;
+    boost::shared_ptr<CBlock> pblock = queueRead.front().second;
+    queueRead.pop_front();
+
+    boost::shared_ptr<CBlock> pchecked;
+    CBlock *pblockChecked = TakePrecheckedBlock(*pblock, pchecked);
+
+    LOCK(cs_main);
+    if (dbp)
+        dbp->nPos = nBlockPos;
+    CValidationState state;
+    if (ProcessBlock(state, NULL, pblockChecked ? pblockChecked : pblock.get(), dbp, pblockChecked != NULL))
+        nLoaded++;
+    return !state.IsError();
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
 
     int nLoaded = 0;
+    // Blocks read ahead of the one being processed, so the precheck threads can work on them
+    std::deque<std::pair<uint64, boost::shared_ptr<CBlock> > > queueRead;
+    unsigned int nReadAhead = nBlockPrecheckThreads > 0 ? MAX_BLOCK_PRECHECK_QUEUE / 2 : 0;
+    bool fAbort = false;
     try {
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64 nStartByte = 0;
@@ -2965,25 +4501,28 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 // read block
                 uint64 nBlockPos = blkdat.GetPos();
                 blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                boost::shared_ptr<CBlock> pblock(new CBlock());
+                blkdat >> *pblock;
                 nRewind = blkdat.GetPos();
 
-                // process block
+                // queue block, and process the oldest one once enough are in flight
                 if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
+                    PrecheckBlock(pblock);
+                    queueRead.push_back(std::make_pair(nBlockPos, pblock));
+                }
+                if (queueRead.size() > nReadAhead && !ProcessExternalBlock(queueRead, dbp, nLoaded)) {
+                    fAbort = true;
+                    break;
                 }
             } catch (std::exception &e) {
                 printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
         }
+        while (!fAbort && !queueRead.empty()) {
+            boost::this_thread::interruption_point();
+            if (!ProcessExternalBlock(queueRead, dbp, nLoaded))
+                fAbort = true;
+        }
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3120,33 +4659,48 @@ void static ProcessGetData(CNode* pfrom)
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
+                // Only the lookups need the chain; the block is read and
+                // pushed without holding cs_main
                 bool send = true;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
                 {
-                    // If the requested block is at a height below our last
-                    // checkpoint, only serve it if it's in the checkpointed chain
-                    int nHeight = ((*mi).second)->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-                    if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
-                       if (!((*mi).second)->IsInMainChain())
-                       {
-                         printf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
-                         send = false;
-                       }
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        pindex = (*mi).second;
+                        // If the requested block is at a height below our last
+                        // checkpoint, only serve it if it's in the checkpointed chain
+                        int nHeight = pindex->nHeight;
+                        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+                        if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
+                           if (!pindex->IsInMainChain())
+                           {
+                             printf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                             send = false;
+                           }
+                        }
+                    } else {
+                        send = false;
                     }
-                } else {
-                    send = false;
+                    hashBest = hashBestChain;
                 }
                 if (send)
                 {
                     // Send block from disk
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // Peers get the stored bytes as they are, with no
+                        // deserializing and reserializing in between
+                        CBlockFileStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                        if (ReadRawBlockFromDisk(ssBlock, pindex))
+                            pfrom->PushMessage("block", ssBlock);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        block.ReadFromDisk(pindex);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3167,67 +4721,193 @@ void static ProcessGetData(CNode* pfrom)
                             // no response
                     }
 
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
-                }
+                    // Trigger them to send a getblocks request for the next batch of inventory
+                    if (inv.hash == pfrom->hashContinue)
+                    {
+                        // Bypass PushInventory, this must send even if redundant,
+                        // and we want it right after the last block so they don't
+                        // wait for other stuff first.
+                        vector<CInv> vInv;
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
+                        pfrom->PushMessage("inv", vInv);
+                        pfrom->hashContinue = 0;
+                    }
+                }
+            }
+            else if (inv.IsKnownType())
+            {
+                // Send stream from relay memory
+                bool pushed = false;
+                {
+                    LOCK(cs_mapRelay);
+                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    if (mi != mapRelay.end()) {
+                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pushed = true;
+                    }
+                }
+                if (!pushed && inv.type == MSG_TX) {
+                    LOCK(mempool.cs);
+                    if (mempool.exists(inv.hash)) {
+                        CTransaction tx = mempool.lookup(inv.hash);
+                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                        ss.reserve(1000);
+                        ss << tx;
+                        pfrom->PushMessage("tx", ss);
+                        pushed = true;
+                    }
+                }
+                if (!pushed) {
+                    vNotFound.push_back(inv);
+                }
+            }
+
+            // Track requests for our stuff.
+            Inventory(inv.hash);
+
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+                break;
+        }
+    }
+
+    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+
+    if (!vNotFound.empty()) {
+        // Let the peer know that we didn't find what it asked for, so it doesn't
+        // have to wait around forever. Currently only SPV clients actually care
+        // about this message: it's needed when they are recursively walking the
+        // dependencies of relevant unconfirmed transactions. SPV clients want to
+        // do that because they want to know about (and store and rebroadcast and
+        // risk analyze) the dependencies of transactions relevant to them, without
+        // having to download the entire memory pool.
+        pfrom->PushMessage("notfound", vNotFound);
+    }
+}
+
+// Accept the transactions of one or more 'tx' messages from a peer, relay
+// those that made it into the pool and resolve the orphans they complete
+void static ProcessTxMessages(CNode* pfrom, const std::vector<CDataStream*> &vTxMsgs)
+{
+    vector<CTransaction> vtx;
+    set<uint256> setSeen;
+    BOOST_FOREACH(CDataStream* pMsg, vTxMsgs)
+    {
+        CTransaction tx;
+        try {
+            *pMsg >> tx;
+        } catch (std::ios_base::failure& e) {
+            printf("ProcessTxMessages() : malformed tx message from %s : %s\n", pfrom->addr.ToString().c_str(), e.what());
+            continue;
+        }
+
+        CInv inv(MSG_TX, tx.GetHash());
+        pfrom->AddInventoryKnown(inv);
+        if (setSeen.insert(inv.hash).second)
+            vtx.push_back(tx);
+    }
+
+    vector<CValidationState> vState;
+    vector<bool> vAccepted;
+    vector<bool> vMissingInputs;
+    int64 nStart = GetTimeMicros();
+    try {
+        mempool.acceptBatch(vtx, true, vState, vAccepted, vMissingInputs);
+    } catch(std::runtime_error &e) {
+        BOOST_FOREACH(CValidationState& state, vState)
+            state.Abort(_("System error: ") + e.what());
+    }
+    if (!vtx.empty())
+    {
+        int64 nTime = (GetTimeMicros() - nStart) / vtx.size();
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            mempool.RecordAcceptTime(nTime);
+    }
+
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        const CTransaction &tx = vtx[i];
+        uint256 hash = tx.GetHash();
+        if (vAccepted[i])
+        {
+            RelayTransaction(tx, hash);
+            mapAlreadyAskedFor.erase(CInv(MSG_TX, hash));
+            vWorkQueue.push_back(hash);
+            vEraseQueue.push_back(hash);
+
+            printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
+                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
+                hash.ToString().c_str(),
+                mempool.mapTx.size());
+        }
+        else if (vMissingInputs[i])
+        {
+            AddOrphanTx(tx);
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            if (nEvicted > 0)
+                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+        }
+        int nDoS = 0;
+        if (vState[i].IsInvalid(nDoS))
+        {
+            printf("%s from %s %s was not accepted into the memory pool\n", hash.ToString().c_str(),
+                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
+            if (nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+        }
+    }
+
+    // Recursively process any orphan transactions that depended on the accepted ones
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    {
+        uint256 hashPrev = vWorkQueue[i];
+        for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
+             mi != mapOrphanTransactionsByPrev[hashPrev].end();
+             ++mi)
+        {
+            const uint256& orphanHash = *mi;
+            CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
+            bool fMissingInputs2 = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+
+            if (orphanTx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
+            {
+                printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
+                RelayTransaction(orphanTx, orphanHash);
+                mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
+                vWorkQueue.push_back(orphanHash);
+                vEraseQueue.push_back(orphanHash);
             }
-            else if (inv.IsKnownType())
+            else if (!fMissingInputs2)
             {
-                // Send stream from relay memory
-                bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
-                }
-                if (!pushed && inv.type == MSG_TX) {
-                    LOCK(mempool.cs);
-                    if (mempool.exists(inv.hash)) {
-                        CTransaction tx = mempool.lookup(inv.hash);
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
-                    }
-                }
-                if (!pushed) {
-                    vNotFound.push_back(inv);
-                }
+                // invalid or too-little-fee orphan
+                vEraseQueue.push_back(orphanHash);
+                printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
             }
-
-            // Track requests for our stuff.
-            Inventory(inv.hash);
-
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
-                break;
         }
     }
 
-    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+    BOOST_FOREACH(uint256 hash, vEraseQueue)
+        EraseOrphanTx(hash);
+}
 
-    if (!vNotFound.empty()) {
-        // Let the peer know that we didn't find what it asked for, so it doesn't
-        // have to wait around forever. Currently only SPV clients actually care
-        // about this message: it's needed when they are recursively walking the
-        // dependencies of relevant unconfirmed transactions. SPV clients want to
-        // do that because they want to know about (and store and rebroadcast and
-        // risk analyze) the dependencies of transactions relevant to them, without
-        // having to download the entire memory pool.
-        pfrom->PushMessage("notfound", vNotFound);
-    }
+// Salt for picking the nodes an address is relayed to. "addr" messages are
+// handled without cs_main on several threads, so it is set up under a lock.
+static CCriticalSection cs_addrRelaySalt;
+
+static uint256 GetAddrRelaySalt()
+{
+    static uint256 hashSalt;
+    LOCK(cs_addrRelaySalt);
+    if (hashSalt == 0)
+        hashSalt = GetRandHash();
+    return hashSalt;
 }
 
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
@@ -3278,10 +4958,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         if (!vRecv.empty())
             vRecv >> pfrom->nStartingHeight;
-        if (!vRecv.empty())
-            vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
-        else
-            pfrom->fRelayTxes = true;
+        {
+            LOCK(pfrom->cs_filter);
+            if (!vRecv.empty())
+                vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
+            else
+                pfrom->fRelayTxes = true;
+        }
 
         if (pfrom->fInbound && addrMe.IsRoutable())
         {
@@ -3396,11 +5079,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
                     uint64 hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = GetAddrRelaySalt() ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hashblake(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -3544,7 +5224,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3573,98 +5253,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTransaction tx;
-        vRecv >> tx;
-
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-        if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
-        {
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-            printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
-                        RelayTransaction(orphanTx, orphanHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanHash);
-                        printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
-                    }
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            printf("%s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
-        }
+        std::vector<CDataStream*> vTxMsgs(1, &vRecv);
+        ProcessTxMessages(pfrom, vTxMsgs);
     }
 
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        // Use the copy the precheck threads already read from these bytes and
+        // validated, if there is one
+        boost::shared_ptr<CBlock> pchecked = TakePrecheckedMessage(vRecv);
         CBlock block;
-        vRecv >> block;
+        if (!pchecked)
+            vRecv >> block;
+        CBlock *pblock = pchecked ? pchecked.get() : &block;
 
-        printf("received block %s\n", block.GetHash().ToString().c_str());
-        // block.print();
+        printf("received block %s\n", pblock->GetHash().ToString().c_str());
+        // pblock->print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
+        CInv inv(MSG_BLOCK, pblock->GetHash());
         pfrom->AddInventoryKnown(inv);
 
         CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
+        if (ProcessBlock(state, pfrom, pblock, NULL, pchecked.get() != NULL) || state.CorruptionPossible())
             mapAlreadyAskedFor.erase(inv);
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
@@ -3675,7 +5286,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -3778,8 +5392,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             delete pfrom->pfilter;
             pfrom->pfilter = new CBloomFilter(filter);
             pfrom->pfilter->UpdateEmptyFull();
+            pfrom->fRelayTxes = true;
         }
-        pfrom->fRelayTxes = true;
     }
 
 
@@ -3827,6 +5441,39 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that touch only the peer, the address manager or structures
+// with their own locks are processed without cs_main, so the handler
+// threads can serve them while another holds it for a block.
+static bool MessageNeedsChainState(const string &strCommand)
+{
+    return !(strCommand == "ping" || strCommand == "addr" || strCommand == "getaddr" ||
+             strCommand == "getdata" || strCommand == "filterload" ||
+             strCommand == "filteradd" || strCommand == "filterclear");
+}
+
+// Whether a queued message is a complete 'tx' message that passes the
+// header and checksum checks, so it can join a batch
+static bool IsTxMessageReady(CNetMessage &msg)
+{
+    if (!msg.complete() || memcmp(msg.hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return false;
+    if (!msg.hdr.IsValid() || msg.hdr.GetCommand() != "tx")
+        return false;
+    uint256 hash = Hashblake(msg.vRecv.begin(), msg.vRecv.begin() + msg.hdr.nMessageSize);
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    return nChecksum == msg.hdr.nChecksum;
+}
+
+static CCriticalSection cs_messagehandlerstats;
+static CMessageHandlerStats messagehandlerstats;
+
+void GetMessageHandlerStats(CMessageHandlerStats &stats)
+{
+    LOCK(cs_messagehandlerstats);
+    stats = messagehandlerstats;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -3901,13 +5548,62 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        // Let the precheck threads start on the blocks queued behind this one
+        if (strCommand == "block" && nBlockPrecheckThreads > 0) {
+            unsigned int nAhead = 0;
+            for (std::deque<CNetMessage>::iterator itAhead = it; itAhead != pfrom->vRecvMsg.end() && itAhead->complete() && nAhead < MAX_BLOCK_PRECHECK_QUEUE / 2; itAhead++) {
+                if (itAhead->hdr.GetCommand() == "block") {
+                    PrecheckBlockMessage(itAhead->vRecv, itAhead->hdr.nMessageSize);
+                    nAhead++;
+                }
+            }
+        }
+
+        // Take the transactions queued right behind this one along, so a
+        // burst of them is accepted as a batch
+        std::vector<CDataStream*> vTxMsgs;
+        if (strCommand == "tx" && pfrom->nVersion != 0) {
+            vTxMsgs.push_back(&vRecv);
+            while (it != pfrom->vRecvMsg.end() && vTxMsgs.size() < MAX_TX_BATCH && IsTxMessageReady(*it)) {
+                vTxMsgs.push_back(&it->vRecv);
+                it++;
+            }
+        }
+
         // Process message
         bool fRet = false;
         try
         {
+            if (MessageNeedsChainState(strCommand))
+            {
+                int64 nStart = GetTimeMicros();
+                int64 nLocked;
+                {
+                    LOCK(cs_main);
+                    nLocked = GetTimeMicros();
+                    if (vTxMsgs.size() > 1) {
+                        ProcessTxMessages(pfrom, vTxMsgs);
+                        fRet = true;
+                    } else
+                        fRet = ProcessMessage(pfrom, strCommand, vRecv);
+                }
+                int64 nWait = nLocked - nStart;
+                int64 nHold = GetTimeMicros() - nLocked;
+                LOCK(cs_messagehandlerstats);
+                messagehandlerstats.nMessages += std::max((size_t)1, vTxMsgs.size());
+                if (vTxMsgs.size() > 1) {
+                    messagehandlerstats.nTxBatches++;
+                    messagehandlerstats.nTxBatched += vTxMsgs.size();
+                }
+                messagehandlerstats.nLockWaitMicros += nWait;
+                messagehandlerstats.nMaxLockWaitMicros = std::max(messagehandlerstats.nMaxLockWaitMicros, (uint64)nWait);
+                messagehandlerstats.nLockHoldMicros += nHold;
+            }
+            else
             {
-                LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
+                LOCK(cs_messagehandlerstats);
+                messagehandlerstats.nMessagesUnlocked++;
             }
             boost::this_thread::interruption_point();
         }
@@ -3993,7 +5689,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4012,25 +5711,27 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            // Filter under cs_vAddrToSend, but push after releasing it, as
+            // PushMessage takes cs_vSend
+            vector<CAddress> vAddrToSend;
+            vector<CAddress> vAddrNew;
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddrToSend.swap(pto->vAddrToSend);
+                vAddrNew.reserve(vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddrNew.push_back(addr);
                 }
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddrNew.size(); i += 1000)
+            {
+                vector<CAddress> vAddr(vAddrNew.begin() + i, vAddrNew.begin() + std::min(i + 1000, (unsigned int)vAddrNew.size()));
                 pto->PushMessage("addr", vAddr);
+            }
         }
 
 
@@ -4153,76 +5854,107 @@ int static FormatHashBlocks(void* pbuffer, unsigned int len)
     return blocks;
 }
 
-static const unsigned int pSHA256InitState[8] =
-{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+uint64 nLastBlockTx = 0;
+uint64 nLastBlockSize = 0;
 
-void SHA256Transform(void* pstate, void* pinput, const void* pinit)
+// Fills a block template from the memory pool, using what the pool keeps
+// on each transaction rather than looking its inputs up again.
+// requires LOCK2(cs_main, mempool.cs)
+class CBlockAssembler
 {
-    SHA256_CTX ctx;
-    unsigned char data[64];
+private:
+    CBlockTemplate *pblocktemplate;
+    CBlockIndex *pindexPrev;
+    unsigned int nBlockMaxSize;
+    bool fPrintPriority;
+    std::set<uint256> setAdded;
+
+    bool AddTx(const CTxMemPoolEntry &entry, double dPriority)
+    {
+        const CTransaction &tx = *entry.ptx;
+        if (tx.IsCoinBase() || !tx.IsFinal())
+            return false;
 
-    SHA256_Init(&ctx);
+        // Size limits
+        if (nBlockSize + entry.nTxSize >= nBlockMaxSize)
+            return false;
 
-    for (int i = 0; i < 16; i++)
-        ((uint32_t*)data)[i] = ByteReverse(((uint32_t*)pinput)[i]);
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = entry.nSigOps;
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
 
-    for (int i = 0; i < 8; i++)
-        ctx.h[i] = ((uint32_t*)pinit)[i];
+        if (!tx.HaveInputs(view))
+            return false;
 
-    SHA256_Update(&ctx, data, sizeof(data));
-    for (int i = 0; i < 8; i++)
-        ((uint32_t*)pstate)[i] = ctx.h[i];
-}
+        int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+        nTxSigOps += tx.GetP2SHSigOpCount(view);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
 
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
+        CValidationState state;
+        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
+            return false;
 
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().c_str());
+        CTxUndo txundo;
+        tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, entry.hash);
+
+        // Added
+        pblocktemplate->block.vtx.push_back(tx);
+        pblocktemplate->vTxFees.push_back(nTxFees);
+        pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += entry.nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+        setAdded.insert(entry.hash);
+
+        if (fPrintPriority)
+        {
+            printf("priority %.1f feeperkb %.1f txid %s\n",
+                   dPriority, double(entry.nFee) / (double(entry.nTxSize)/1000.0), entry.hash.ToString().c_str());
+        }
+        return true;
     }
-};
-
 
-uint64 nLastBlockTx = 0;
-uint64 nLastBlockSize = 0;
-
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    CCoinsViewCache view;
+    uint64 nBlockSize;
+    uint64 nBlockTx;
+    int nBlockSigOps;
+    int64 nFees;
+
+    CBlockAssembler(CBlockTemplate *pblocktemplateIn, CBlockIndex *pindexPrevIn, unsigned int nBlockMaxSizeIn) :
+        pblocktemplate(pblocktemplateIn), pindexPrev(pindexPrevIn), nBlockMaxSize(nBlockMaxSizeIn),
+        fPrintPriority(GetBoolArg("-printpriority")), view(*pcoinsTip, true),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0) {}
+
+    bool Contains(const uint256 &hash) const { return setAdded.count(hash) > 0; }
+
+    // Add a transaction after those of its unconfirmed ancestors not in
+    // the block yet. Stops at the first one that does not fit or check out.
+    bool AddWithAncestors(const CTxMemPoolEntry &entry, double dPriority)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        if (Contains(entry.hash))
+            return true;
+        std::vector<const CTxMemPoolEntry*> vAncestors, vPackage;
+        mempool.GetSortedAncestors(entry.hash, vAncestors);
+        uint64 nPackageSize = 0;
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vAncestors)
+            if (!Contains(pentry->hash)) {
+                vPackage.push_back(pentry);
+                nPackageSize += pentry->nTxSize;
+            }
+        vPackage.push_back(&entry);
+        nPackageSize += entry.nTxSize;
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+            return false;
+
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, vPackage)
+            if (!AddTx(*pentry, pentry == &entry ? dPriority : pentry->GetPriority(pindexPrev->nHeight)))
+                return false;
+        return true;
     }
 };
 
@@ -4236,13 +5968,13 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
 
     // Create coinbase tx
     CTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
+    txNew.MutableVin().resize(1);
+    txNew.MutableVin()[0].prevout.SetNull();
+    txNew.MutableVout().resize(1);
     CPubKey pubkey;
     if (!reservekey.GetReservedKey(pubkey))
         return NULL;
-    txNew.vout[0].scriptPubKey << pubkey << OP_CHECKSIG;
+    txNew.MutableVout()[0].scriptPubKey << pubkey << OP_CHECKSIG;
 
     // Add our coinbase tx as first transaction
     pblock->vtx.push_back(txNew);
@@ -4273,183 +6005,63 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = pindexBest;
-        CCoinsViewCache view(*pcoinsTip, true);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority");
+        CBlockAssembler assembler(pblocktemplate.get(), pindexPrev, nBlockMaxSize);
+        int64 nStart = GetTimeMicros();
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        // High-priority transactions first, regardless of the fees they pay.
+        // Priority changes with the height, so it is ranked here, but from
+        // what the pool worked out when each transaction entered.
+        if (nBlockPrioritySize > 0)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
+            vector<pair<double, const CTxMemPoolEntry*> > vecPriority;
+            vecPriority.reserve(mempool.mapEntry.size());
+            for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+                vecPriority.push_back(make_pair(mi->second.GetPriority(pindexPrev->nHeight), &mi->second));
+            std::make_heap(vecPriority.begin(), vecPriority.end());
 
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
+            while (!vecPriority.empty())
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                double dPriority = vecPriority.front().first;
+                const CTxMemPoolEntry &entry = *vecPriority.front().second;
+                std::pop_heap(vecPriority.begin(), vecPriority.end());
+                vecPriority.pop_back();
+
+                // Prioritize by fee once past the priority size or we run out of high-priority
+                // transactions:
+                if ((assembler.nBlockSize + entry.nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250))
+                    break;
+                assembler.AddWithAncestors(entry, dPriority);
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
         }
 
-        // Collect transactions into block
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        // Then by the fee rate of each transaction together with its
+        // unconfirmed ancestors, walking the pool's index from the top
+        BOOST_FOREACH(const CTxMemPoolEntry* pentry, mempool.setByAncestorFee)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            if (assembler.Contains(pentry->hash))
                 continue;
 
             // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!tx.HaveInputs(view))
-                continue;
-
-            int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
-
-            nTxSigOps += tx.GetP2SHSigOpCount(view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            CValidationState state;
-            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
-
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
+            double dFeePerKb = double(pentry->nFeesWithAncestors) / (double(pentry->nSizeWithAncestors)/1000.0);
+            if (dFeePerKb < CTransaction::nMinTxFee)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
+                if (assembler.nBlockSize >= nBlockMinSize)
+                    break;
+                if (assembler.nBlockSize + pentry->nSizeWithAncestors >= nBlockMinSize)
+                    continue;
             }
+            assembler.AddWithAncestors(*pentry, pentry->GetPriority(pindexPrev->nHeight));
         }
 
+        uint64 nBlockTx = assembler.nBlockTx;
+        uint64 nBlockSize = assembler.nBlockSize;
+        nFees = assembler.nFees;
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
-        printf("CreateNewBlock(): total size %"PRI64u"\n", nBlockSize);
+        printf("CreateNewBlock(): total size %"PRI64u", %"PRI64u" txs from %"PRIszu" in %.2fms\n",
+               nBlockSize, nBlockTx, mempool.mapEntry.size(), (GetTimeMicros() - nStart) * 0.001);
 
-        pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees, pblock->nBits);
+        pblock->vtx[0].MutableVout()[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees, pblock->nBits);
         pblocktemplate->vTxFees[0] = -nFees;
 
         // Fill in header
@@ -4459,11 +6071,13 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
         pblock->nNonce         = 0;
 
         // Calculate nVvalue dependet nBits
-        pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees, pblock->nBits);
+        pblock->vtx[0].MutableVout()[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees, pblock->nBits);
         pblocktemplate->vTxFees[0] = -nFees;
 
-        pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        pblock->vtx[0].MutableVin()[0].scriptSig = CScript() << OP_0 << OP_0;
         pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
+        // Build the tree once; extranonce updates only rehash the coinbase path
+        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         CBlockIndex indexDummy(*pblock);
         indexDummy.pprev = pindexPrev;
@@ -4489,10 +6103,10 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].MutableVin()[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].GetVin()[0].scriptSig.size() <= 100);
 
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->hashMerkleRoot = pblock->UpdateMerkleTreeCoinbase();
 }
 
 
@@ -4534,8 +6148,10 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
     for (unsigned int i = 0; i < sizeof(tmp)/4; i++)
         ((unsigned int*)&tmp)[i] = ByteReverse(((unsigned int*)&tmp)[i]);
 
-    // Precalc the first half of the first hash, which stays constant
-    SHA256Transform(pmidstate, &tmp.block, pSHA256InitState);
+    // Precalc the Blake-256 state over the first 64 bytes, which stays constant
+    sph_blake256_context ctxMidstate;
+    pblock->GetMidstate(ctxMidstate);
+    memcpy(pmidstate, ctxMidstate.H, 32);
 
     memcpy(pdata, &tmp.block, 128);
     memcpy(phash1, &tmp.hash1, 64);
@@ -4554,7 +6170,7 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     printf("BlakecoinMiner:\n");
     printf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex().c_str(), hashTarget.GetHex().c_str());
     pblock->print();
-    printf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue).c_str());
+    printf("generated %s\n", FormatMoney(pblock->vtx[0].GetVout()[0].nValue).c_str());
 
     // Found a solution
     {
@@ -4580,6 +6196,9 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
+// Nonces hashed between checks for a new tip, a stop request or a time update
+static const unsigned int nMinerScanBatch = 0x10000;
+
 void static BitcoinMiner(CWallet *pwallet)
 {
     printf("BlakecoinMiner started\n");
@@ -4612,25 +6231,14 @@ void static BitcoinMiner(CWallet *pwallet)
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
         int64 nStart = GetTime();
         uint256 hash;
-        // unsigned int nHashesDone = 0;
         while (true)
         {
-//            unsigned int nNonceFound;
-
-            hash = pblock->GetHash();
-            if (hash <= hashTarget){
-                // nHashesDone += pblock->nNonce;
-                SetThreadPriority(THREAD_PRIORITY_NORMAL);
-
-                printf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex().c_str(), hashTarget.GetHex().c_str());
-                pblock->print();
+            // Scan a batch of nonces, several at a time on SIMD capable CPUs
+            unsigned int nNonceFound;
+            bool fFound = ScanNonces(*pblock, pblock->nNonce, nMinerScanBatch, hashTarget, nNonceFound, hash);
+            // A hit ends the scan early, at the nonce found
+            unsigned int nScanned = fFound ? nNonceFound - pblock->nNonce + 1 : nMinerScanBatch;
 
-                CheckWork(pblock, *pwalletMain, reservekey);
-                SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                break;
-            }
-            ++pblock->nNonce;
-            
             // Meter hashes/sec
             static int64 nHashCounter;
             if (nHPSTimerStart == 0)
@@ -4639,8 +6247,7 @@ void static BitcoinMiner(CWallet *pwallet)
                 nHashCounter = 0;
             }
             else
-                // nHashCounter += nHashesDone;
-                nHashCounter += 1;
+                nHashCounter += nScanned;
             if (GetTimeMillis() - nHPSTimerStart > 4000)
             {
                 static CCriticalSection cs;
@@ -4661,11 +6268,25 @@ void static BitcoinMiner(CWallet *pwallet)
                 }
             }
 
+            if (fFound)
+            {
+                pblock->nNonce = nNonceFound;
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
+
+                printf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex().c_str(), hashTarget.GetHex().c_str());
+                pblock->print();
+
+                CheckWork(pblock, *pwalletMain, reservekey);
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                break;
+            }
+
             // Check for stop or if block needs to be rebuilt
             boost::this_thread::interruption_point();
             if (vNodes.empty())
                 break;
-            if (++pblock->nNonce >= 0xffff0000)
+            pblock->nNonce += nMinerScanBatch;
+            if (pblock->nNonce >= 0xffff0000)
                 break;
             if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
                 break;
@@ -4774,10 +6395,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        poolBlockIndex.Clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -6,14 +6,18 @@
 #define BITCOIN_MAIN_H
 
 #include "bignum.h"
+#include "blockfile.h"
+#include "blockmap.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
 
 #include <list>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 class CWallet;
+class CBlockHeader;
 class CBlock;
 class CBlockIndex;
 class CKeyItem;
@@ -37,8 +41,17 @@ static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 30000;
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 /** The maximum allowed number of signature check operations in a block (network rule) */
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
+/** Default for -maxmempool, memory limit of the transaction memory pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Defaults for -limitancestorcount and -limitancestorsize: the most transactions,
+ *  and kilobytes, a relayed pool transaction may have in the pool counting itself
+ *  and its ancestors, or any of those ancestors counting itself and its descendants */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** The maximum number of queued 'tx' messages from one peer accepted as a batch */
+static const unsigned int MAX_TX_BATCH = 100;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -62,6 +75,12 @@ static const int COINBASE_MATURITY = 120;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of coin database prefetch threads */
+static const int MAX_COINS_PREFETCH_THREADS = 16;
+/** Maximum number of block precheck threads */
+static const int MAX_BLOCK_PRECHECK_THREADS = 16;
+/** Maximum number of blocks held by the precheck queue */
+static const unsigned int MAX_BLOCK_PRECHECK_QUEUE = 32;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -75,9 +94,9 @@ extern CScript COINBASE_FLAGS;
 
 
 
-
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
+extern std::vector<CBlockIndex*> vBlockIndexByHeight;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -100,8 +119,13 @@ extern bool fImporting;
 extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
+extern int nCoinsPrefetchThreads;
+extern int nBlockPrecheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+extern size_t nMaxMempoolUsage;
+extern unsigned int nMempoolAncestorLimit;
+extern unsigned int nMempoolAncestorSizeLimit;
 
 // Settings
 extern int64 nTransactionFee;
@@ -130,14 +154,16 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block. fChecked means pblock itself already passed CheckBlock. */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Open the serialized bytes of a stored block, without deserializing it */
+bool ReadRawBlockFromDisk(CBlockFileStream &ssBlock, const CBlockIndex* pindex);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -164,6 +190,9 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlockTemplate* CreateNewBlock(CReserveKey& reservekey);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Scan nCount nonces from nStart for a header hash <= hashTarget, several nonces at a time when the CPU allows */
+bool ScanNonces(const CBlockHeader& header, unsigned int nStart, unsigned int nCount, const uint256& hashTarget,
+                unsigned int& nNonceFound, uint256& hashFound);
 /** Do mining precalculation */
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 /** Check mined block */
@@ -180,10 +209,13 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
-/** Connect/disconnect blocks until pindexNew is the new tip of the active block chain */
-bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew);
+/** Connect/disconnect blocks until pindexNew is the new tip of the active block chain.
+    pblock, if given, is an already checked block on that chain that need not be read from disk. */
+bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew, CBlock *pblock = NULL);
 /** Find the best known block, and make it the tip of the block chain */
-bool ConnectBestBlock(CValidationState &state);
+bool ConnectBestBlock(CValidationState &state, CBlock *pblock = NULL);
+/** Stop the block precheck threads */
+void StopBlockPrecheckThreads();
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Verify a signature */
@@ -471,6 +503,12 @@ enum GetMinFee_mode
 
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks. A transaction can contain multiple inputs and outputs.
+ *
+ * A transaction read from the network or disk caches its txid, and copies
+ * of it carry the cached txid along. The fields are read through GetVersion(),
+ * GetVin(), GetVout() and GetLockTime(), and only changed through
+ * MutableVin(), MutableVout(), SetVersion() and SetLockTime(), which drop the
+ * cache; after that the txid is computed on each GetHash() call.
  */
 class CTransaction
 {
@@ -478,11 +516,18 @@ public:
     static int64 nMinTxFee;
     static int64 nMinRelayTxFee;
     static const int CURRENT_VERSION=1;
+
+private:
     int nVersion;
     std::vector<CTxIn> vin;
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+    // memory only: txid cached when the transaction is deserialized, see above
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
+public:
     CTransaction()
     {
         SetNull();
@@ -495,6 +540,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            UpdateHash();
     )
 
     void SetNull()
@@ -503,6 +550,37 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        fHashCached = false;
+    }
+
+    int GetVersion() const { return nVersion; }
+    const std::vector<CTxIn>& GetVin() const { return vin; }
+    const std::vector<CTxOut>& GetVout() const { return vout; }
+    unsigned int GetLockTime() const { return nLockTime; }
+
+    // Writable access to the fields; each drops the cached txid
+    std::vector<CTxIn>& MutableVin()
+    {
+        fHashCached = false;
+        return vin;
+    }
+
+    std::vector<CTxOut>& MutableVout()
+    {
+        fHashCached = false;
+        return vout;
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        fHashCached = false;
+        nVersion = nVersionIn;
+    }
+
+    void SetLockTime(unsigned int nLockTimeIn)
+    {
+        fHashCached = false;
+        nLockTime = nLockTimeIn;
     }
 
     bool IsNull() const
@@ -512,9 +590,19 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+private:
+    void UpdateHash() const
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+    }
+
+public:
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
     {
         // Time based nLockTime implemented in 0.1.6
@@ -812,9 +900,9 @@ public:
     bool ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
     {
         // Open history file to read
-        CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlockUndo::ReadFromDisk() : OpenBlockFile failed");
+        CBlockFileStream filein(SER_DISK, CLIENT_VERSION);
+        if (!OpenBlockFileRecord(pos, "rev", sizeof(uint256), filein))
+            return error("CBlockUndo::ReadFromDisk() : OpenBlockFileRecord failed");
 
         // Read block
         uint256 hashChecksum;
@@ -905,7 +993,7 @@ public:
     int nVersion;
 
     // construct a CCoins from a CTransaction, at a given height
-    CCoins(const CTransaction &tx, int nHeightIn) : fCoinBase(tx.IsCoinBase()), vout(tx.vout), nHeight(nHeightIn), nVersion(tx.nVersion) { }
+    CCoins(const CTransaction &tx, int nHeightIn) : fCoinBase(tx.IsCoinBase()), vout(tx.GetVout()), nHeight(nHeightIn), nVersion(tx.GetVersion()) { }
 
     // empty constructor
     CCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
@@ -936,6 +1024,14 @@ public:
         return !(a == b);
     }
 
+    // heap memory held by this object (output array plus scripts)
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = vout.capacity() * sizeof(CTxOut);
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += out.scriptPubKey.capacity();
+        return nUsage;
+    }
+
     // calculate number of bytes for the bitmask, and its number of non-zero bytes
     // each bit in the bitmask represents the availability of one output, but the
     // availabilities of the first two outputs are encoded separately
@@ -1100,11 +1196,14 @@ private:
 public:
     CScriptCheck() {}
     CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        scriptPubKey(txFromIn.vout[txToIn.GetVin()[nInIn].prevout.n].scriptPubKey),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
 
     bool operator()() const;
 
+    // Check again without some of the flags, to tell what a failure is down to
+    void ClearFlags(unsigned int nFlagsClear) { nFlags &= ~nFlagsClear; }
+
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
@@ -1147,7 +1246,7 @@ public:
     IMPLEMENT_SERIALIZE
     (
         nSerSize += SerReadWrite(s, *(CTransaction*)this, nType, nVersion, ser_action);
-        nVersion = this->nVersion;
+        nVersion = this->GetVersion();
         READWRITE(hashBlock);
         READWRITE(vMerkleBranch);
         READWRITE(nIndex);
@@ -1318,6 +1417,21 @@ public:
         return Hashblake(BEGIN(nVersion), END(nNonce));
     }
 
+    // Blake-256 state after the first 64 bytes of the header. Only the last
+    // 16 bytes (end of hashMerkleRoot, nTime, nBits, nNonce) are left to hash,
+    // so a miner can reuse the midstate for every nonce of the same template.
+    void GetMidstate(sph_blake256_context& ctxMidstate) const
+    {
+        sph_blake256_midstate(&ctxMidstate, BEGIN(nVersion));
+    }
+
+    uint256 GetHashFromMidstate(const sph_blake256_context& ctxMidstate) const
+    {
+        uint256 hash;
+        sph_blake256_close_midstate(&ctxMidstate, BEGIN(nVersion) + 64, END(nNonce) - (BEGIN(nVersion) + 64), BEGIN(hash));
+        return hash;
+    }
+
     int64 GetBlockTime() const
     {
         return (int64)nTime;
@@ -1373,23 +1487,48 @@ public:
 
     uint256 BuildMerkleTree() const
     {
-        vMerkleTree.clear();
-        BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
+        // Size the whole tree up front, as each level is hashed straight into it
+        unsigned int nTreeSize = vtx.size();
+        for (unsigned int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+            nTreeSize += (nSize + 1) / 2;
+        vMerkleTree.resize(nTreeSize);
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            vMerkleTree[i] = vtx[i].GetHash();
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash4(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            MerkleHashPairs(&vMerkleTree[j], &vMerkleTree[j+nSize], nSize / 2);
+            // an odd last node is paired with itself
+            if (nSize & 1)
+                vMerkleTree[j+nSize+nSize/2] = Hash4(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                                     BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
     }
 
+    // Recompute only the path from the coinbase to the root, after a change
+    // to vtx[0] alone (such as a new extranonce). The rest of the tree must
+    // still match vtx; if it was never built, the whole tree is built.
+    uint256 UpdateMerkleTreeCoinbase() const
+    {
+        unsigned int nTreeSize = vtx.size();
+        for (unsigned int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+            nTreeSize += (nSize + 1) / 2;
+        if (vtx.empty() || vMerkleTree.size() != nTreeSize)
+            return BuildMerkleTree();
+        vMerkleTree[0] = vtx[0].GetHash();
+        int j = 0;
+        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            int i2 = std::min(1, nSize-1);
+            vMerkleTree[j+nSize] = Hash4(BEGIN(vMerkleTree[j]),  END(vMerkleTree[j]),
+                                         BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2]));
+            j += nSize;
+        }
+        return vMerkleTree.back();
+    }
+
     const uint256 &GetTxHash(unsigned int nIndex) const {
         assert(vMerkleTree.size() > 0); // BuildMerkleTree must have been called first
         assert(nIndex < vtx.size());
@@ -1458,9 +1597,9 @@ public:
         SetNull();
 
         // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+        CBlockFileStream filein(SER_DISK, CLIENT_VERSION);
+        if (!OpenBlockFileRecord(pos, "blk", 0, filein))
+            return error("CBlock::ReadFromDisk() : OpenBlockFileRecord failed");
 
         // Read block
         try {
@@ -1506,8 +1645,9 @@ public:
      *  of problems. Note that in any case, coins may be modified. */
     bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins.
+    // fChecked skips CheckBlock, for a block object that already passed it.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, bool fChecked=false);
 
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
@@ -1621,6 +1761,9 @@ public:
     // (memory only) pointer to the index of the *active* successor of this block
     CBlockIndex* pnext;
 
+    // (memory only) pointer to the index of some further predecessor of this block
+    CBlockIndex* pskip;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -1659,6 +1802,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1680,6 +1824,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1737,6 +1882,15 @@ public:
         return (int64)nTime;
     }
 
+    // Find the ancestor of this block at the given height in O(log n) steps,
+    // following pskip where that does not overshoot
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
+    // Build the skip pointer; pprev and nHeight must be set, and all
+    // ancestors must already have theirs
+    void BuildSkip();
+
     CBigNum GetBlockWork() const
     {
         CBigNum bnTarget;
@@ -1970,7 +2124,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -2006,8 +2160,8 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            int nHeight = pindex->nHeight - nStep;
+            pindex = (nHeight >= 0 ? pindex->GetAncestor(nHeight) : NULL);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -2021,7 +2175,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2040,7 +2194,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2056,7 +2210,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2083,20 +2237,147 @@ public:
 
 
 
+/** What block assembly needs to know about a memory pool transaction,
+ *  worked out once when it enters the pool */
+class CTxMemPoolEntry
+{
+public:
+    uint256 hash;
+    const CTransaction* ptx;
+    int64 nFee;
+    unsigned int nTxSize;
+    unsigned int nSigOps;       // legacy sigops
+    unsigned int nHeight;       // best height when it entered
+    double dPriority;           // priority at nHeight
+    int64 nValueInChain;        // value of its confirmed inputs, including ones mined since
+    size_t nUsage;              // memory held for it in the pool
+
+    // This transaction together with all its ancestors in the pool
+    int64 nFeesWithAncestors;
+    uint64 nSizeWithAncestors;
+    unsigned int nCountWithAncestors;
+
+    // This transaction together with all its descendants in the pool
+    int64 nFeesWithDescendants;
+    uint64 nSizeWithDescendants;
+    unsigned int nCountWithDescendants;
+
+    CTxMemPoolEntry() : ptx(NULL), nFee(0), nTxSize(0), nSigOps(0), nHeight(0), dPriority(0), nValueInChain(0), nUsage(0),
+                        nFeesWithAncestors(0), nSizeWithAncestors(0), nCountWithAncestors(0),
+                        nFeesWithDescendants(0), nSizeWithDescendants(0), nCountWithDescendants(0) {}
+
+    // Inputs age by one block per block, so priority grows linearly in their value
+    double GetPriority(unsigned int nCurrentHeight) const
+    {
+        return dPriority + (double)nValueInChain * ((int)nCurrentHeight - (int)nHeight) / nTxSize;
+    }
+};
+
+/** Orders memory pool entries by the fee rate of the transaction and its
+ *  ancestors together, highest first */
+struct CompareTxMemPoolEntryByAncestorFee
+{
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        double f1 = (double)a->nFeesWithAncestors * b->nSizeWithAncestors;
+        double f2 = (double)b->nFeesWithAncestors * a->nSizeWithAncestors;
+        if (f1 != f2)
+            return f1 > f2;
+        return a->hash < b->hash;
+    }
+};
+
+/** Orders memory pool entries by the lower of the fee rate of the transaction
+ *  alone and of it together with its descendants, highest first, so a cheap
+ *  parent whose children pay for it is not the first to go */
+struct CompareTxMemPoolEntryByDescendantScore
+{
+    static void GetScore(const CTxMemPoolEntry* p, double &dFees, double &dSize)
+    {
+        dFees = (double)p->nFee;
+        dSize = (double)p->nTxSize;
+        if ((double)p->nFeesWithDescendants * p->nTxSize < dFees * p->nSizeWithDescendants)
+        {
+            dFees = (double)p->nFeesWithDescendants;
+            dSize = (double)p->nSizeWithDescendants;
+        }
+    }
+
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        double dFeesA, dSizeA, dFeesB, dSizeB;
+        GetScore(a, dFeesA, dSizeA);
+        GetScore(b, dFeesB, dSizeB);
+        double f1 = dFeesA * dSizeB;
+        double f2 = dFeesB * dSizeA;
+        if (f1 != f2)
+            return f1 > f2;
+        return a->hash < b->hash;
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // Kept alongside mapTx, for block assembly
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<CTxMemPoolEntry*, CompareTxMemPoolEntryByAncestorFee> setByAncestorFee;
+    std::set<CTxMemPoolEntry*, CompareTxMemPoolEntryByDescendantScore> setByDescendantScore;
+
+    // Memory accounting and eviction, see TrimToSize
+    size_t nTotalUsage;
+    uint64 nTotalTxSize;
+    uint64 nEvicted;
+    uint64 nEvictedBytes;
+
+    // How long AcceptToMemoryPool took: below 0.1, 1, 10, 100 and 1000 ms, and longer
+    static const unsigned int ACCEPT_TIME_BUCKETS = 6;
+    uint64 nAcceptTime[ACCEPT_TIME_BUCKETS];
 
+    CTxMemPool() : nTotalUsage(0), nTotalTxSize(0), nEvicted(0), nEvictedBytes(0)
+    {
+        memset(nAcceptTime, 0, sizeof(nAcceptTime));
+    }
+
+private:
+    void CalculateAncestors(const CTransaction &tx, std::set<uint256> &setAncestors);
+    void UpdateAncestorState(CTxMemPoolEntry &entry, const std::set<uint256> &setAncestors);
+    void CalculateDescendants(const uint256 &hash, std::set<uint256> &setDescendants);
+    void UpdateDescendants(const std::set<uint256> &setDescendants);
+    void UpdateDescendantState(CTxMemPoolEntry &entry, const std::set<uint256> &setDescendants);
+    void UpdateAncestors(const std::set<uint256> &setAncestors);
+    void UpdateAncestorTotals(const uint256 &hash, int64 nFee, int64 nSize, int nCount);
+    void UpdateDescendantTotals(const uint256 &hash, int64 nFee, int64 nSize, int nCount);
+    bool CheckPackageLimits(const CTransaction &tx, unsigned int nSize);
+    void UpdateChildPriority(const uint256 &hash);
+    bool CheckConflicts(const CTransaction &tx, CTransaction* &ptxOld);
+    bool RateLimitFree(unsigned int nSize, bool fCharge);
+    bool CheckPoolInputs(CValidationState &state, const CTransaction &tx, const uint256 &hash, CCoinsViewCache &view,
+                         bool fLimitFree, bool &fFree, std::vector<CScriptCheck> *pvChecks);
+
+public:
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
+    /** Accept several transactions at once, in order, so later ones may spend
+        earlier ones: their inputs are fetched in one pass and the scripts of
+        all of them are verified together on the script check threads */
+    void acceptBatch(std::vector<CTransaction> &vtx, bool fLimitFree, std::vector<CValidationState> &vState,
+                     std::vector<bool> &vAccepted, std::vector<bool> &vMissingInputs);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
+    /** The unconfirmed ancestors of a pool transaction, parents before children */
+    void GetSortedAncestors(const uint256 &hash, std::vector<const CTxMemPoolEntry*> &vAncestors);
+    /** Evict the lowest fee rate transactions, with whatever spends them,
+        until the pool holds no more than nLimit bytes; see
+        CompareTxMemPoolEntryByDescendantScore */
+    void TrimToSize(size_t nLimit);
+    void RecordAcceptTime(int64 nMicros);
 
     unsigned long size()
     {
@@ -2130,6 +2411,46 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** Hasher for txids in the coins cache. Transaction ids can be ground by an
+ * attacker, so the key is mixed with a per-cache random salt to keep bucket
+ * placement unpredictable.
+ */
+class CCoinsKeyHasher
+{
+private:
+    uint64 k0, k1;
+
+public:
+    CCoinsKeyHasher();
+
+    size_t operator()(const uint256 &txid) const {
+        uint64 a, b;
+        memcpy(&a, txid.begin(), 8);
+        memcpy(&b, txid.begin() + 8, 8);
+        uint64 h = (a ^ k0) * 0x9E3779B97F4A7C15ULL;
+        h = (h ^ (h >> 29) ^ b ^ k1) * 0xBF58476D1CE4E5B9ULL;
+        return (size_t)(h ^ (h >> 32));
+    }
+};
+
+/** Entry in a CCoinsViewCache */
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char flags;
+    unsigned int nLastUsed; // value of the cache's use clock at the last access
+    size_t nUsage; // bytes accounted for this entry in its cache
+
+    enum Flags {
+        DIRTY = (1 << 0), // differs from the version in the parent view
+        FRESH = (1 << 1), // the parent view has no unspent version of this txid
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0), nLastUsed(0), nUsage(0) { }
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2150,8 +2471,9 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock).
+    // Only entries flagged DIRTY are applied.
+    virtual bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2174,7 +2496,8 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    CCoinsView *GetBackend() { return base; }
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -2183,7 +2506,17 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Bytes used by the entries of cacheCoins (excluding the bucket array)
+    size_t cachedCoinsUsage;
+
+    // Advanced whenever the best block changes; used to find cold entries
+    unsigned int nUseClock;
+
+    // Entry last handed out through GetCoins(txid) for modification; its
+    // memory usage is re-measured before the cache is touched again.
+    CCoinsCacheEntry *pentryModified;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2194,13 +2527,28 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is marked dirty, so use AccessCoins for read-only access.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a read-only reference to a CCoins. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
+    // SetCoins for the outputs of a new transaction. With fFresh the caller
+    // vouches that the base has no unspent version of txid; the base is not
+    // asked, as that would cost a database read for every new transaction.
+    bool SetCoins(const uint256 &txid, const CCoins &coins, bool fFresh);
+
+    // Check whether txid is in this cache, without consulting the base
+    bool HaveCoinsInCache(const uint256 &txid) const;
+
+    // Add an unmodified copy of the base's coins for txid, read elsewhere.
+    // Does nothing if the cache already has an entry for it.
+    void PrimeCoins(const uint256 &txid, CCoins &coins);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -2208,8 +2556,25 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache (in bytes)
+    size_t DynamicMemoryUsage();
+
+    // Calculate the memory used by the modified entries (in bytes)
+    size_t DirtyUsage();
+
+    // Copy all modified entries into mapDirty and mark them clean here, so they
+    // can be written to the base view outside of this cache. Returns the bytes
+    // copied.
+    size_t TakeDirty(CCoinsMap &mapDirty);
+
+    // Evict least recently used clean entries until the cache uses at most
+    // nTargetUsage bytes. Returns the number of entries evicted.
+    unsigned int Trim(size_t nTargetUsage);
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+    void UpdateUsage(CCoinsCacheEntry &entry);
+    void SettleModified();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -2228,6 +2593,77 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Timings of coin database writes */
+struct CCoinsFlushStats
+{
+    uint64 nFlushes;
+    uint64 nEntriesWritten;
+    uint64 nBytesWritten;
+    uint64 nEvicted;
+    unsigned int nLastFlushEntries;
+    size_t nLastFlushBytes;
+    int64 nLastFlushTime;  // milliseconds
+    int64 nMaxFlushTime;   // milliseconds
+    int64 nTotalFlushTime; // milliseconds
+    int64 nTotalWaitTime;  // milliseconds spent by cs_main holders waiting on a write
+    bool fPending;
+    size_t nPendingBytes;  // memory held by the snapshot being written
+
+    CCoinsFlushStats() : nFlushes(0), nEntriesWritten(0), nBytesWritten(0), nEvicted(0), nLastFlushEntries(0), nLastFlushBytes(0),
+                         nLastFlushTime(0), nMaxFlushTime(0), nTotalFlushTime(0), nTotalWaitTime(0), fPending(false), nPendingBytes(0) {}
+};
+
+/** Write the modified entries of pcoinsTip to the coin database. With fBackground,
+    they are copied to the coins flush thread and written without holding cs_main;
+    the cache is trimmed first so that it and the copy fit in nCoinCacheUsage. */
+bool FlushCoinsTip(bool fBackground);
+/** Wait for any pending background coins write and stop the flush thread */
+void StopCoinsFlushThread();
+/** Retrieve coins cache write statistics */
+void GetCoinsFlushStats(CCoinsFlushStats &stats);
+/** Counters of the block validation pipeline */
+struct CBlockPrecheckStats
+{
+    uint64 nChecked;  // blocks checked ahead of time
+    uint64 nFailed;   // of which failed their checks
+    uint64 nHits;     // blocks that were processed using an early check
+    uint64 nMisses;   // blocks that arrived at processing unchecked
+    uint64 nEvicted;  // checked blocks dropped unused
+    unsigned int nQueued;
+
+    CBlockPrecheckStats() : nChecked(0), nFailed(0), nHits(0), nMisses(0), nEvicted(0), nQueued(0) {}
+};
+
+/** Retrieve block precheck statistics */
+void GetBlockPrecheckStats(CBlockPrecheckStats &stats);
+/** Number of blocks connected since startup, and per second over the last minute and since the first */
+void GetBlockConnectRate(uint64 &nBlocks, double &dRecent, double &dOverall);
+
+/** Time the message handler threads spend on cs_main */
+struct CMessageHandlerStats
+{
+    uint64 nMessages;          // messages processed under cs_main
+    uint64 nMessagesUnlocked;  // messages processed without it
+    uint64 nLockWaitMicros;    // total time spent waiting to acquire cs_main
+    uint64 nMaxLockWaitMicros;
+    uint64 nLockHoldMicros;    // total time cs_main was held processing messages
+    uint64 nTxBatches;         // bursts of 'tx' messages accepted together
+    uint64 nTxBatched;         // transactions in those bursts
+
+    CMessageHandlerStats() : nMessages(0), nMessagesUnlocked(0), nLockWaitMicros(0), nMaxLockWaitMicros(0), nLockHoldMicros(0),
+                             nTxBatches(0), nTxBatched(0) {}
+};
+
+/** Retrieve cs_main contention statistics of the message handlers */
+void GetMessageHandlerStats(CMessageHandlerStats &stats);
+
+/** Start reading the coins spent by a block that is about to be connected */
+void StartCoinsPrefetch(const CBlock &block);
+/** Add the coins read for hashBlock to pcoinsTip (a prefetch for another block is discarded) */
+void FinishCoinsPrefetch(const uint256 &hashBlock);
+/** Stop the coins prefetch threads */
+void StopCoinsPrefetchThreads();
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
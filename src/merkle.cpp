@@ -0,0 +1,186 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+#include "simd.h"
+
+//
+// Merkle tree level hashing.
+//
+// Every inner node of a merkle tree is the double SHA-256 of its two 32 byte
+// children: one 64 byte message block, one constant padding block, and one
+// block for the second hash. Nodes of a level are independent, so several of
+// them run through the same SHA-256 rounds side by side, one per SIMD lane.
+//
+
+typedef void (*MerkleHashPairsFn)(const uint256* pIn, uint256* pOut, unsigned int nPairs);
+
+static void MerkleHashPairsScalar(const uint256* pIn, uint256* pOut, unsigned int nPairs)
+{
+    for (unsigned int i = 0; i < nPairs; i++)
+        pOut[i] = Hash4(BEGIN(pIn[2*i]), END(pIn[2*i]), BEGIN(pIn[2*i+1]), END(pIn[2*i+1]));
+}
+
+#ifdef USE_SIMD
+
+static const uint32_t pSHA256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t pSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// SHA-256 compression of message W into state S, over NLANES independent
+// messages. Expects VADD, VXOR, VAND, VOR, VROTR, VSHR and VSET1 to be
+// defined for the lane type.
+#define MERKLE_CH(x, y, z)  VXOR(z, VAND(x, VXOR(y, z)))
+#define MERKLE_MAJ(x, y, z) VOR(VAND(x, y), VAND(z, VOR(x, y)))
+#define MERKLE_BSIG0(x)     VXOR(VROTR(x, 2), VXOR(VROTR(x, 13), VROTR(x, 22)))
+#define MERKLE_BSIG1(x)     VXOR(VROTR(x, 6), VXOR(VROTR(x, 11), VROTR(x, 25)))
+#define MERKLE_SSIG0(x)     VXOR(VROTR(x, 7), VXOR(VROTR(x, 18), VSHR(x, 3)))
+#define MERKLE_SSIG1(x)     VXOR(VROTR(x, 17), VXOR(VROTR(x, 19), VSHR(x, 10)))
+
+#define MERKLE_TRANSFORM(VTYPE, S, W) do { \
+        VTYPE w[64]; \
+        for (int t = 0; t < 16; t++) \
+            w[t] = W[t]; \
+        for (int t = 16; t < 64; t++) \
+            w[t] = VADD(VADD(MERKLE_SSIG1(w[t-2]), w[t-7]), VADD(MERKLE_SSIG0(w[t-15]), w[t-16])); \
+        VTYPE a = S[0], b = S[1], c = S[2], d = S[3]; \
+        VTYPE e = S[4], f = S[5], g = S[6], h = S[7]; \
+        for (int t = 0; t < 64; t++) \
+        { \
+            VTYPE T1 = VADD(VADD(h, MERKLE_BSIG1(e)), VADD(MERKLE_CH(e, f, g), VADD(VSET1(pSHA256K[t]), w[t]))); \
+            VTYPE T2 = VADD(MERKLE_BSIG0(a), MERKLE_MAJ(a, b, c)); \
+            h = g; g = f; f = e; e = VADD(d, T1); \
+            d = c; c = b; b = a; a = VADD(T1, T2); \
+        } \
+        S[0] = VADD(S[0], a); S[1] = VADD(S[1], b); S[2] = VADD(S[2], c); S[3] = VADD(S[3], d); \
+        S[4] = VADD(S[4], e); S[5] = VADD(S[5], f); S[6] = VADD(S[6], g); S[7] = VADD(S[7], h); \
+    } while (0)
+
+// Lane loop shared by the SIMD kernels: gather NLANES pairs into lane
+// order, double hash them, and scatter the digests back. Any remainder is
+// finished with the scalar code.
+#define MERKLE_LOOP(VTYPE, NLANES) do { \
+        unsigned int n = 0; \
+        for (; n + NLANES <= nPairs; n += NLANES) \
+        { \
+            uint32_t pnWords[16][NLANES]; \
+            for (int i = 0; i < NLANES; i++) \
+            { \
+                const unsigned char* p = pIn[2*(n+i)].begin(); \
+                for (int k = 0; k < 8; k++) \
+                    pnWords[k][i] = ReadBE32(p + 4 * k); \
+                p = pIn[2*(n+i)+1].begin(); \
+                for (int k = 0; k < 8; k++) \
+                    pnWords[8+k][i] = ReadBE32(p + 4 * k); \
+            } \
+            VTYPE S[8], W[16]; \
+            for (int k = 0; k < 8; k++) \
+                S[k] = VSET1(pSHA256Init[k]); \
+            for (int k = 0; k < 16; k++) \
+                W[k] = VLOAD(pnWords[k]); \
+            MERKLE_TRANSFORM(VTYPE, S, W); \
+            /* padding block of a 64 byte message */ \
+            W[0] = VSET1(0x80000000); \
+            for (int k = 1; k < 15; k++) \
+                W[k] = VSET1(0); \
+            W[15] = VSET1(512); \
+            MERKLE_TRANSFORM(VTYPE, S, W); \
+            /* second hash, of the 32 byte digest */ \
+            for (int k = 0; k < 8; k++) \
+            { \
+                W[k] = S[k]; \
+                S[k] = VSET1(pSHA256Init[k]); \
+            } \
+            W[8] = VSET1(0x80000000); \
+            for (int k = 9; k < 15; k++) \
+                W[k] = VSET1(0); \
+            W[15] = VSET1(256); \
+            MERKLE_TRANSFORM(VTYPE, S, W); \
+            for (int k = 0; k < 8; k++) \
+                VSTORE(pnWords[k], S[k]); \
+            for (int i = 0; i < NLANES; i++) \
+                for (int k = 0; k < 8; k++) \
+                    WriteBE32(pOut[n+i].begin() + 4 * k, pnWords[k][i]); \
+        } \
+        MerkleHashPairsScalar(pIn + 2 * n, pOut + n, nPairs - n); \
+    } while (0)
+
+#define SIMD_LANES 4
+#include "simdlanes.h"
+
+__attribute__((target("sse2")))
+static void MerkleHashPairsSSE2(const uint256* pIn, uint256* pOut, unsigned int nPairs)
+{
+    MERKLE_LOOP(__m128i, 4);
+}
+
+#undef SIMD_LANES
+#define SIMD_LANES 8
+#include "simdlanes.h"
+
+__attribute__((target("avx2")))
+static void MerkleHashPairsAVX2(const uint256* pIn, uint256* pOut, unsigned int nPairs)
+{
+    MERKLE_LOOP(__m256i, 8);
+}
+
+#undef SIMD_LANES
+#include "simdlanes.h"
+
+// Compare a kernel against OpenSSL on a few pseudo-random pairs, so a broken
+// compiler or CPU can never produce a wrong merkle root.
+static bool MerkleHashPairsSelfTest(MerkleHashPairsFn fn)
+{
+    const unsigned int nPairs = 19; // not a multiple of any lane count
+    uint256 pIn[2 * nPairs], pOut[nPairs], pExpected[nPairs];
+    uint256 hash = 0;
+    for (unsigned int i = 0; i < 2 * nPairs; i++)
+    {
+        hash = Hashblake(BEGIN(hash), END(hash));
+        pIn[i] = hash;
+    }
+    fn(pIn, pOut, nPairs);
+    MerkleHashPairsScalar(pIn, pExpected, nPairs);
+    for (unsigned int i = 0; i < nPairs; i++)
+        if (pOut[i] != pExpected[i])
+            return false;
+    return true;
+}
+
+#endif
+
+static MerkleHashPairsFn SelectMerkleHashPairs()
+{
+#ifdef USE_SIMD
+    return SelectSIMDKernel("MerkleHashPairs()", "SHA-256", MerkleHashPairsScalar,
+                            MerkleHashPairsSSE2, MerkleHashPairsAVX2, MerkleHashPairsSelfTest);
+#else
+    printf("MerkleHashPairs() : using scalar SHA-256 kernel\n");
+    return MerkleHashPairsScalar;
+#endif
+}
+
+void MerkleHashPairs(const uint256* pIn, uint256* pOut, unsigned int nPairs)
+{
+    static const MerkleHashPairsFn fn = SelectMerkleHashPairs();
+
+    // A single pair is not worth the lane shuffling
+    if (nPairs < 2)
+        MerkleHashPairsScalar(pIn, pOut, nPairs);
+    else
+        fn(pIn, pOut, nPairs);
+}
@@ -54,6 +54,7 @@ uint64 nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageHandlerThreads = 1;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
@@ -624,9 +625,111 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+//
+// Message bodies are received into storage sized from the header up front.
+// Large ones are read from the socket straight into it, and once processed
+// their storage goes back to a pool, so relaying blocks neither copies
+// every byte twice nor allocates, faults in and frees a buffer per block.
+// Only the socket thread takes buffers, while the message handlers return
+// them, so the pool is shared rather than kept per thread.
+//
+class CRecvBufferPool
+{
+private:
+    // smaller buffers are left to the allocator
+    static const unsigned int nMinPooledSize = 0x10000;
+    // anything larger than a block message is freed: the size comes from a
+    // header the peer sent, and may be up to MAX_SIZE
+    static const unsigned int nMaxPooledSize = MAX_BLOCK_SIZE + 0x1000;
+    static const unsigned int nMaxPooled = 8;
+    static const size_t nMaxPooledBytes = 8 * MAX_BLOCK_SIZE;
+
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree;
+    size_t nPooledBytes;
+
+public:
+    CRecvBufferPool() : nPooledBytes(0) {}
+
+    // Make vRecv nSize bytes, reusing pooled storage where it fits
+    void Get(CDataStream &vRecv, unsigned int nSize)
+    {
+        if (nSize >= nMinPooledSize && nSize <= nMaxPooledSize)
+        {
+            LOCK(cs);
+            // the smallest buffer that fits
+            int nBest = -1;
+            for (unsigned int i = 0; i < vFree.size(); i++)
+                if (vFree[i].capacity() >= nSize && (nBest < 0 || vFree[i].capacity() < vFree[nBest].capacity()))
+                    nBest = i;
+            if (nBest >= 0)
+            {
+                nPooledBytes -= vFree[nBest].capacity();
+                vRecv.swap(vFree[nBest]);
+                vFree.erase(vFree.begin() + nBest);
+            }
+        }
+        vRecv.resize(nSize);
+    }
+
+    void Put(CDataStream &vRecv)
+    {
+        CSerializeData vch;
+        vRecv.swap(vch);
+        if (vch.capacity() < nMinPooledSize || vch.capacity() > nMaxPooledSize)
+            return;
+        vch.clear();
+        LOCK(cs);
+        // Make room by dropping smaller buffers, keeping the larger ones
+        while (!vFree.empty() && (vFree.size() >= nMaxPooled || nPooledBytes + vch.capacity() > nMaxPooledBytes))
+        {
+            std::vector<CSerializeData>::iterator itSmallest = vFree.begin();
+            for (std::vector<CSerializeData>::iterator it = vFree.begin(); it != vFree.end(); it++)
+                if (it->capacity() < itSmallest->capacity())
+                    itSmallest = it;
+            if (itSmallest->capacity() >= vch.capacity())
+                return;
+            nPooledBytes -= itSmallest->capacity();
+            vFree.erase(itSmallest);
+        }
+        nPooledBytes += vch.capacity();
+        vFree.push_back(CSerializeData());
+        vFree.back().swap(vch);
+    }
+};
+
+static CRecvBufferPool recvbufferpool;
+
+CNetMessage::~CNetMessage()
+{
+    recvbufferpool.Put(vRecv);
+}
+
+// requires LOCK(cs_vRecvMsg)
+char *CNode::GetRecvBodyBuffer(unsigned int &nBytes)
+{
+    nBytes = 0;
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    nBytes = msg.hdr.nMessageSize - msg.nDataPos;
+    return &msg.vRecv[msg.nDataPos];
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedBodyBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    assert(nBytes <= msg.hdr.nMessageSize - msg.nDataPos);
+    msg.nDataPos += nBytes;
+    if (msg.complete())
+        WakeMessageHandler(this);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -646,10 +749,16 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        if (msg.complete())
+            fComplete = true;
+
         pch += handled;
         nBytes -= handled;
     }
 
+    if (fComplete)
+        WakeMessageHandler(this);
+
     return true;
 }
 
@@ -680,7 +789,7 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    recvbufferpool.Get(vRecv, hdr.nMessageSize);
 
     return nCopy;
 }
@@ -708,6 +817,7 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 void SocketSendData(CNode *pnode)
 {
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    bool fWasFull = pnode->nSendSize >= SendBufferSize();
 
     while (it != pnode->vSendMsg.end()) {
         const CSerializeData &data = *it;
@@ -745,13 +855,436 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // Message processing pauses while the send buffer is full
+    if (fWasFull && pnode->nSendSize < SendBufferSize())
+        WakeMessageHandler(pnode);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+/** Nodes waiting for a message handler thread. A node is claimed by one
+ *  handler at a time, which keeps its messages in order; work arriving for a
+ *  claimed node is picked up again when the handler releases it.
+ *  Signalled from the socket thread and from relaying code, so its mutex is
+ *  never held while taking another lock. Nodes are deleted under cs_vNodes
+ *  after being removed from here, so anything taken from the queue under
+ *  cs_vNodes is still alive.
+ */
+class CMessageHandlerQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CNode*> queue;
+    std::set<CNode*> setQueued;
+    std::set<CNode*> setClaimed;
+    std::set<CNode*> setPending;
+    int64 nLastSweep;
+    bool fSweeping;
+
+    // requires lock on mutex
+    void Enqueue(CNode* pnode)
+    {
+        if (!setQueued.insert(pnode).second)
+            return;
+        queue.push_back(pnode);
+        cond.notify_one();
+    }
+
+public:
+    CMessageHandlerQueue() : nLastSweep(0), fSweeping(false) {}
+
+    void Push(CNode* pnode)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (setClaimed.count(pnode))
+            setPending.insert(pnode);
+        else
+            Enqueue(pnode);
+    }
+
+    void Remove(CNode* pnode)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        setPending.erase(pnode);
+        if (setQueued.erase(pnode))
+            queue.erase(std::remove(queue.begin(), queue.end(), pnode), queue.end());
+    }
+
+    // Sleep until a node is queued or a sweep of all nodes is due, which
+    // only one thread does at a time. Returns true if the caller is to sweep.
+    bool Wait(int64 nSweepInterval)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true)
+        {
+            int64 nNow = GetTimeMillis();
+            if (!fSweeping && nNow - nLastSweep >= nSweepInterval)
+            {
+                fSweeping = true;
+                nLastSweep = nNow;
+                return true;
+            }
+            if (!queue.empty())
+                return false;
+            int64 nDelay = fSweeping ? nSweepInterval : nLastSweep + nSweepInterval - nNow;
+            cond.timed_wait(lock, boost::get_system_time() + boost::posix_time::milliseconds(nDelay));
+        }
+    }
+
+    void EndSweep()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fSweeping = false;
+    }
+
+    // Claim a node for the sweep; fails if another handler has it.
+    // requires LOCK(cs_vNodes)
+    bool Claim(CNode* pnode)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!setClaimed.insert(pnode).second)
+            return false;
+        if (setQueued.erase(pnode))
+            queue.erase(std::remove(queue.begin(), queue.end(), pnode), queue.end());
+        return true;
+    }
+
+    // Claim up to nMax queued nodes
+    // requires LOCK(cs_vNodes)
+    void Take(std::vector<CNode*> &vNodesRet, unsigned int nMax)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!queue.empty() && vNodesRet.size() < nMax)
+        {
+            CNode* pnode = queue.front();
+            queue.pop_front();
+            setQueued.erase(pnode);
+            setClaimed.insert(pnode);
+            vNodesRet.push_back(pnode);
+        }
+    }
+
+    // Hand a claimed node back, queueing it if work came in meanwhile
+    void Release(CNode* pnode)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        setClaimed.erase(pnode);
+        if (setPending.erase(pnode))
+            Enqueue(pnode);
+    }
+};
+
+static CMessageHandlerQueue messagehandlerqueue;
+
+void WakeMessageHandler(CNode* pnode)
+{
+    messagehandlerqueue.Push(pnode);
+}
+
+static void RemoveFromMessageHandler(CNode* pnode)
+{
+    messagehandlerqueue.Remove(pnode);
+}
+
+#ifdef WIN32
+// Wait up to nTimeout ms with select(). Readiness is level triggered here,
+// so every flag is recomputed on each call.
+static void SocketEventsSelect(int nTimeout, bool &fListenReady)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = nTimeout * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    vector<CNode*> vSelected;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            pnode->fSocketRecvReady = false;
+            pnode->fSocketSendReady = false;
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+            vSelected.push_back(pnode);
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            printf("socket select error %d\n", nErr);
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(nTimeout);
+    }
+
+    fListenReady = false;
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (FD_ISSET(hListenSocket, &fdsetRecv))
+            fListenReady = true;
+    // Nodes are only deleted by this thread, so the pointers are still valid
+    BOOST_FOREACH(CNode* pnode, vSelected)
+    {
+        SOCKET hSocket = pnode->hSocket;
+        if (hSocket == INVALID_SOCKET)
+            continue;
+        pnode->fSocketRecvReady = FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError);
+        pnode->fSocketSendReady = FD_ISSET(hSocket, &fdsetSend);
+    }
+}
+#else
+// Wait up to nTimeout ms with poll(). Readiness is level triggered here,
+// so every flag is recomputed on each call. Unlike select() there is no
+// FD_SETSIZE limit on the descriptors that can be waited for.
+static void SocketEventsPoll(int nTimeout, bool &fListenReady)
+{
+    vector<struct pollfd> vpollfd;
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        struct pollfd pfd;
+        pfd.fd = hListenSocket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        vpollfd.push_back(pfd);
+    }
+    unsigned int nListen = vpollfd.size();
+    vector<CNode*> vSelected;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            pnode->fSocketRecvReady = false;
+            pnode->fSocketSendReady = false;
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            // Same send-before-receive logic as SocketEventsSelect
+            struct pollfd pfd;
+            pfd.fd = pnode->hSocket;
+            pfd.events = 0;
+            pfd.revents = 0;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty())
+                    pfd.events = POLLOUT;
+            }
+            if (pfd.events == 0)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    pfd.events = POLLIN;
+            }
+            vpollfd.push_back(pfd);
+            vSelected.push_back(pnode);
+        }
+    }
+
+    fListenReady = false;
+    int nPoll = poll(vpollfd.empty() ? NULL : &vpollfd[0], vpollfd.size(), nTimeout);
+    if (nPoll < 0)
+    {
+        if (errno != EINTR)
+        {
+            printf("socket poll error %d\n", errno);
+            MilliSleep(nTimeout);
+        }
+        return;
+    }
+
+    for (unsigned int i = 0; i < nListen; i++)
+        if (vpollfd[i].revents & POLLIN)
+            fListenReady = true;
+    // Nodes are only deleted by this thread, so the pointers are still valid
+    for (unsigned int i = 0; i < vSelected.size(); i++)
+    {
+        short revents = vpollfd[nListen + i].revents;
+        vSelected[i]->fSocketRecvReady = (revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+        vSelected[i]->fSocketSendReady = (revents & POLLOUT) != 0;
+    }
+}
+#endif
+
+#ifdef USE_EPOLL
+// Wait up to nTimeout ms with edge triggered epoll: only sockets whose state
+// changed are reported, whatever the number of connections. A flag stays set
+// until the socket runs dry, so readiness is not lost while a node is skipped
+// for flow control or a busy lock.
+static void SocketEventsEpoll(int hEpoll, int nTimeout, bool &fListenReady)
+{
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hEpoll, events, 256, nTimeout);
+    if (nEvents < 0)
+    {
+        if (errno != EINTR)
+        {
+            printf("socket epoll_wait error %d\n", errno);
+            MilliSleep(nTimeout);
+        }
+        return;
+    }
+    // Nodes are only deleted by this thread after their socket was closed,
+    // which also drops them from the epoll set
+    for (int i = 0; i < nEvents; i++)
+    {
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (pnode == NULL)
+        {
+            fListenReady = true;
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->fSocketRecvReady = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSocketSendReady = true;
+    }
+}
+#endif
+
+// Accept pending connections on a listen socket until it would block.
+// Returns false if it had to stop early.
+static bool AcceptConnections(SOCKET hListenSocket)
+{
+    while (true)
+    {
+#ifdef USE_IPV6
+        struct sockaddr_storage sockaddr;
+#else
+        struct sockaddr sockaddr;
+#endif
+        socklen_t len = sizeof(sockaddr);
+        SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+        CAddress addr;
+        int nInbound = 0;
+
+        if (hSocket == INVALID_SOCKET)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEWOULDBLOCK)
+                return true;
+            printf("socket error accept failed: %d\n", nErr);
+            return false;
+        }
+
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->fInbound)
+                    nInbound++;
+        }
+
+        if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+        {
+            {
+                LOCK(cs_setservAddNodeAddresses);
+                if (!setservAddNodeAddresses.count(addr))
+                    closesocket(hSocket);
+            }
+        }
+        else if (CNode::IsBanned(addr))
+        {
+            printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+            closesocket(hSocket);
+        }
+        else
+        {
+            printf("accepted connection %s\n", addr.ToString().c_str());
+            CNode* pnode = new CNode(hSocket, addr, "", true);
+            pnode->AddRef();
+            {
+                LOCK(cs_vNodes);
+                vNodes.push_back(pnode);
+            }
+        }
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fListenReady = false;
+    bool fMoreWork = false;
+
+#ifdef USE_EPOLL
+    int hEpoll = epoll_create(1024);
+    if (hEpoll < 0)
+        printf("epoll_create failed (%d), waiting for sockets with poll()\n", errno);
+    else
+    {
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        {
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLET;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+                printf("listen socket epoll_ctl error %d\n", errno);
+        }
+        // Connections may already be pending
+        fListenReady = true;
+    }
+    // The descriptor is left to process exit, as the thread is interrupted
+    // rather than returning
+#endif
+
     while (true)
     {
         //
@@ -807,6 +1340,7 @@ void ThreadSocketHandler()
                     if (fDelete)
                     {
                         vNodesDisconnected.remove(pnode);
+                        RemoveFromMessageHandler(pnode);
                         delete pnode;
                     }
                 }
@@ -820,143 +1354,31 @@ void ThreadSocketHandler()
 
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+#ifdef USE_EPOLL
+        if (hEpoll >= 0)
+            SocketEventsEpoll(hEpoll, fMoreWork ? 10 : 50, fListenReady);
+        else
+#endif
+#ifdef WIN32
+            SocketEventsSelect(50, fListenReady);
+#else
+            SocketEventsPoll(50, fListenReady);
+#endif
         boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        fMoreWork = false;
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (fListenReady)
         {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
+            fListenReady = false;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (hListenSocket != INVALID_SOCKET && !AcceptConnections(hListenSocket))
+                    fListenReady = true;
         }
 
 
@@ -974,23 +1396,61 @@ void ThreadSocketHandler()
         {
             boost::this_thread::interruption_point();
 
+#ifdef USE_EPOLL
+            // Nodes stay registered until their socket is closed, which
+            // removes them from the epoll set
+            if (hEpoll >= 0 && !pnode->fSocketRegistered && pnode->hSocket != INVALID_SOCKET)
+            {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.ptr = pnode;
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == 0)
+                    pnode->fSocketRegistered = true;
+                else
+                {
+                    printf("socket epoll_ctl error %d\n", errno);
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+#endif
+
             //
             // Receive
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fSocketRecvReady)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
+                    // Edge triggered readiness only clears once recv() would
+                    // block; read a few buffers per round so no peer starves
+                    // the others, and stop while the receive buffer is full.
+                    for (int nReads = 0; nReads < 4 && pnode->fSocketRecvReady; nReads++)
                     {
-                        // typical socket buffer is 8K-64K
+                        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                            pnode->GetTotalRecvSize() > ReceiveFloodSize())
+                            break;
+
+                        // typical socket buffer is 8K-64K. The rest of a
+                        // large message body goes straight into the message,
+                        // anything else through pchBuf, which can take in
+                        // several small messages with one recv().
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        unsigned int nBodyBytes;
+                        char *pchBody = pnode->GetRecvBodyBuffer(nBodyBytes);
+                        bool fDirect = pchBody != NULL && nBodyBytes >= sizeof(pchBuf) / 4;
+                        int nBytes;
+                        if (fDirect)
+                            nBytes = recv(pnode->hSocket, pchBody, nBodyBytes, MSG_DONTWAIT);
+                        else
+                            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (fDirect)
+                                pnode->ReceivedBodyBytes(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1006,15 +1466,24 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketRecvReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
                             }
                         }
+                        if (pnode->hSocket == INVALID_SOCKET)
+                            pnode->fSocketRecvReady = false;
                     }
+                    if (pnode->fSocketRecvReady && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                        fMoreWork = true;
                 }
+                else
+                    fMoreWork = true;
             }
 
             //
@@ -1022,11 +1491,20 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SocketSendData(pnode);
+                {
+                    if (!pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+                    // Whatever is left did not fit; readiness is reported
+                    // again once the socket drains
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketSendReady = false;
+                }
+                else if (!pnode->vSendMsg.empty())
+                    fMoreWork = true;
             }
 
             //
@@ -1059,7 +1537,10 @@ void ThreadSocketHandler()
                 pnode->Release();
         }
 
-        MilliSleep(10);
+#ifdef USE_EPOLL
+        if (hEpoll < 0)
+#endif
+            MilliSleep(10);
     }
 }
 
@@ -1615,70 +2096,80 @@ void ThreadMessageHandler()
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
-        bool fHaveSyncNode = false;
+        // Nodes with work wake a handler as it arises. Every node still
+        // gets a pass each 100ms, for the work that is driven by time:
+        // trickled inventory, getdata requests, pings and starting a sync.
+        bool fSweep = messagehandlerqueue.Wait(100);
 
+        bool fHaveSyncNode = false;
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-                if (pnode == pnodeSync)
-                    fHaveSyncNode = true;
+            if (fSweep) {
+                // nodes other handlers are busy with wait for the next sweep
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (messagehandlerqueue.Claim(pnode))
+                        vNodesCopy.push_back(pnode);
+                    if (pnode == pnodeSync)
+                        fHaveSyncNode = true;
+                }
+            } else {
+                // share a burst of work out between the handlers
+                messagehandlerqueue.Take(vNodesCopy, 8);
             }
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
 
-        if (!fHaveSyncNode)
+        if (fSweep && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Trickle to one random node per sweep
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fSweep && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
+            if (!pnode->fDisconnect)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                // Receive messages. The socket thread only holds this lock
+                // while it copies received bytes in, so waiting for it cannot
+                // lose a wakeup the way skipping the node would.
                 {
+                    LOCK(pnode->cs_vRecvMsg);
                     if (!ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // One message is handled per pass; come back for the
+                    // rest unless the send buffer has to drain first
                     if (pnode->nSendSize < SendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
-                            fSleep = false;
+                            WakeMessageHandler(pnode);
                         }
                     }
                 }
-            }
-            boost::this_thread::interruption_point();
 
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                // Send messages
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                        SendMessages(pnode, pnode == pnodeTrickle);
+                }
             }
+            messagehandlerqueue.Release(pnode);
             boost::this_thread::interruption_point();
         }
+        if (fSweep)
+            messagehandlerqueue.EndSweep();
 
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
-
-        if (fSleep)
-            MilliSleep(100);
     }
 }
 
@@ -1879,7 +2370,8 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1970,9 +2462,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
+        LOCK(pnode->cs_filter);
         if(!pnode->fRelayTxes)
             continue;
-        LOCK(pnode->cs_filter);
         if (pnode->pfilter)
         {
             if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
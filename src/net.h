@@ -26,8 +26,15 @@ class CNode;
 class CBlockIndex;
 extern int nBestHeight;
 
+/** Wake the message handler for a node with work: a complete message,
+    room in a full send buffer, or inventory to relay */
+void WakeMessageHandler(CNode* pnode);
 
 
+
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
@@ -75,6 +82,7 @@ extern uint64 nLocalServices;
 extern uint64 nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -128,6 +136,9 @@ public:
         nDataPos = 0;
     }
 
+    // hands the storage of vRecv back for reuse
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -188,10 +199,15 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // socket readiness, only touched by the socket handler thread
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
+    bool fSocketRegistered;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
+    // Protected by cs_filter.
     bool fRelayTxes;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
@@ -215,6 +231,7 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -245,6 +262,9 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketRecvReady = false;
+        fSocketSendReady = false;
+        fSocketRegistered = false;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
@@ -299,6 +319,15 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // Where the body of the message being received still has bytes to
+    // come, the place to receive them into, and how many there are.
+    // requires LOCK(cs_vRecvMsg)
+    char *GetRecvBodyBuffer(unsigned int &nBytes);
+
+    // Account for nBytes received into the buffer from GetRecvBodyBuffer
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedBodyBytes(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -322,6 +351,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -330,6 +360,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -347,9 +378,11 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (setInventoryKnown.count(inv))
+                return;
+            vInventoryToSend.push_back(inv);
         }
+        WakeMessageHandler(this);
     }
 
     void AskFor(const CInv& inv)
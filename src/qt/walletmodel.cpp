@@ -44,7 +44,7 @@ qint64 WalletModel::getBalance(const CCoinControl *coinControl) const
         std::vector<COutput> vCoins;
         wallet->AvailableCoins(vCoins, true, coinControl);
         BOOST_FOREACH(const COutput& out, vCoins)
-            nBalance += out.tx->vout[out.i].nValue;   
+            nBalance += out.tx->GetVout()[out.i].nValue;   
         
         return nBalance;
     }
@@ -430,14 +430,14 @@ void WalletModel::listCoins(std::map<QString, std::vector<COutput> >& mapCoins)
     {
         COutput cout = out;
         
-        while (wallet->IsChange(cout.tx->vout[cout.i]) && cout.tx->vin.size() > 0 && wallet->IsMine(cout.tx->vin[0]))
+        while (wallet->IsChange(cout.tx->GetVout()[cout.i]) && cout.tx->GetVin().size() > 0 && wallet->IsMine(cout.tx->GetVin()[0]))
         {
-            if (!wallet->mapWallet.count(cout.tx->vin[0].prevout.hash)) break;
-            cout = COutput(&wallet->mapWallet[cout.tx->vin[0].prevout.hash], cout.tx->vin[0].prevout.n, 0);
+            if (!wallet->mapWallet.count(cout.tx->GetVin()[0].prevout.hash)) break;
+            cout = COutput(&wallet->mapWallet[cout.tx->GetVin()[0].prevout.hash], cout.tx->GetVin()[0].prevout.n, 0);
         }
 
         CTxDestination address;
-        if(!ExtractDestination(cout.tx->vout[cout.i].scriptPubKey, address)) continue;
+        if(!ExtractDestination(cout.tx->GetVout()[cout.i].scriptPubKey, address)) continue;
         mapCoins[CBitcoinAddress(address).ToString().c_str()].push_back(out);
     }
 }
@@ -126,6 +126,31 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the size and memory usage of the transaction memory pool, what was evicted to keep it below -maxmempool,\n"
+            "and how long transactions took to be accepted.");
+
+    Object ret;
+    LOCK(mempool.cs);
+    ret.push_back(Pair("size", (boost::int64_t)mempool.mapTx.size()));
+    ret.push_back(Pair("bytes", (boost::int64_t)mempool.nTotalTxSize));
+    ret.push_back(Pair("usage", (boost::int64_t)mempool.nTotalUsage));
+    ret.push_back(Pair("maxmempool", (boost::int64_t)nMaxMempoolUsage));
+    ret.push_back(Pair("evicted", (boost::int64_t)mempool.nEvicted));
+    ret.push_back(Pair("evictedusage", (boost::int64_t)mempool.nEvictedBytes));
+
+    const char *pszBuckets[CTxMemPool::ACCEPT_TIME_BUCKETS] = { "<0.1ms", "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+    Object accepttime;
+    for (unsigned int i = 0; i < CTxMemPool::ACCEPT_TIME_BUCKETS; i++)
+        accepttime.push_back(Pair(pszBuckets[i], (boost::int64_t)mempool.nAcceptTime[i]));
+    ret.push_back(Pair("accepttime", accepttime));
+    return ret;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -183,6 +208,114 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getcoinscacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoinscacheinfo\n"
+            "Returns memory usage of the unspent output cache and timings of its writes to disk.");
+
+    CCoinsFlushStats stats;
+    GetCoinsFlushStats(stats);
+
+    Object ret;
+    {
+        LOCK(cs_main);
+        ret.push_back(Pair("usage", (boost::int64_t)pcoinsTip->DynamicMemoryUsage()));
+        ret.push_back(Pair("limit", (boost::int64_t)nCoinCacheUsage));
+        ret.push_back(Pair("pendingusage", (boost::int64_t)stats.nPendingBytes));
+        ret.push_back(Pair("transactions", (boost::int64_t)pcoinsTip->GetCacheSize()));
+    }
+    ret.push_back(Pair("flushes", (boost::int64_t)stats.nFlushes));
+    ret.push_back(Pair("flushpending", stats.fPending));
+    ret.push_back(Pair("lastflushtransactions", (boost::int64_t)stats.nLastFlushEntries));
+    ret.push_back(Pair("lastflushbytes", (boost::int64_t)stats.nLastFlushBytes));
+    ret.push_back(Pair("lastflushms", (boost::int64_t)stats.nLastFlushTime));
+    ret.push_back(Pair("maxflushms", (boost::int64_t)stats.nMaxFlushTime));
+    ret.push_back(Pair("totalflushms", (boost::int64_t)stats.nTotalFlushTime));
+    ret.push_back(Pair("totalwaitms", (boost::int64_t)stats.nTotalWaitTime));
+    ret.push_back(Pair("writtentransactions", (boost::int64_t)stats.nEntriesWritten));
+    ret.push_back(Pair("writtenbytes", (boost::int64_t)stats.nBytesWritten));
+    ret.push_back(Pair("evicted", (boost::int64_t)stats.nEvicted));
+    return ret;
+}
+
+Value getvalidationinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getvalidationinfo\n"
+            "Returns block connection throughput and statistics of the block precheck threads.");
+
+    uint64 nBlocks;
+    double dRecent, dOverall;
+    {
+        LOCK(cs_main);
+        GetBlockConnectRate(nBlocks, dRecent, dOverall);
+    }
+    CBlockPrecheckStats stats;
+    GetBlockPrecheckStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("blocksconnected", (boost::int64_t)nBlocks));
+    ret.push_back(Pair("blockspersec", dRecent));
+    ret.push_back(Pair("avgblockspersec", dOverall));
+    ret.push_back(Pair("precheckthreads", nBlockPrecheckThreads));
+    ret.push_back(Pair("prechecked", (boost::int64_t)stats.nChecked));
+    ret.push_back(Pair("precheckfailed", (boost::int64_t)stats.nFailed));
+    ret.push_back(Pair("precheckhits", (boost::int64_t)stats.nHits));
+    ret.push_back(Pair("precheckmisses", (boost::int64_t)stats.nMisses));
+    ret.push_back(Pair("precheckevicted", (boost::int64_t)stats.nEvicted));
+    ret.push_back(Pair("precheckqueued", (boost::int64_t)stats.nQueued));
+    return ret;
+}
+
+Value getblockfilecacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockfilecacheinfo\n"
+            "Returns statistics of the memory-mapped block and undo files.");
+
+    CBlockFileCacheStats stats;
+    GetBlockFileCacheStats(stats);
+
+    uint64 nLookups = stats.nHits + stats.nMisses;
+    Object ret;
+    ret.push_back(Pair("files", (boost::int64_t)stats.nFilesMapped));
+    ret.push_back(Pair("bytesmapped", (boost::int64_t)stats.nBytesMapped));
+    ret.push_back(Pair("hits", (boost::int64_t)stats.nHits));
+    ret.push_back(Pair("misses", (boost::int64_t)stats.nMisses));
+    ret.push_back(Pair("hitrate", nLookups ? (double)stats.nHits / nLookups : 0.0));
+    ret.push_back(Pair("evictions", (boost::int64_t)stats.nEvictions));
+    ret.push_back(Pair("bufferedreads", (boost::int64_t)stats.nBufferedReads));
+    return ret;
+}
+
+Value getmessagehandlerinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmessagehandlerinfo\n"
+            "Returns the number of message handler threads, the time they spent waiting for and holding the chain lock,\n"
+            "and how many bursts of transactions were accepted together.");
+
+    CMessageHandlerStats stats;
+    GetMessageHandlerStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("threads", nMessageHandlerThreads));
+    ret.push_back(Pair("messageslocked", (boost::int64_t)stats.nMessages));
+    ret.push_back(Pair("messagesunlocked", (boost::int64_t)stats.nMessagesUnlocked));
+    ret.push_back(Pair("lockwaitmicros", (boost::int64_t)stats.nLockWaitMicros));
+    ret.push_back(Pair("maxlockwaitmicros", (boost::int64_t)stats.nMaxLockWaitMicros));
+    ret.push_back(Pair("lockholdmicros", (boost::int64_t)stats.nLockHoldMicros));
+    ret.push_back(Pair("avglockwaitmicros", stats.nMessages ? (double)stats.nLockWaitMicros / stats.nMessages : 0.0));
+    ret.push_back(Pair("txbatches", (boost::int64_t)stats.nTxBatches));
+    ret.push_back(Pair("txbatched", (boost::int64_t)stats.nTxBatched));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -6,6 +6,7 @@
 #include "main.h"
 #include "db.h"
 #include "init.h"
+#include "ui_interface.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -13,15 +14,211 @@ using namespace std;
 
 static CReserveKey* pMiningKey = NULL;
 
+// Builds block templates ahead of the mining calls: as soon as the tip
+// changes, and every few seconds while the memory pool changes, so getwork
+// and getblocktemplate find one ready instead of making the miner wait for
+// it. It only runs while miners have asked for work in the last ten minutes.
+class CBlockTemplateBuilder
+{
+private:
+    // protects the members up to nNextRefresh. fTipChanged and
+    // fMempoolChanged record changes since the last build began, so the
+    // thread can tell whether a build is due without taking cs_main.
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fNotified;
+    bool fTipChanged;
+    bool fMempoolChanged;
+    int64 nLastRequest;
+    int64 nNextRefresh;
+
+    // protected by cs_main
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64 nBuilt;
+
+    // requires LOCK2(cs_main, pwalletMain->cs_wallet)
+    void Build()
+    {
+        // Changes from here on are caught by the next build
+        bool fTipChangedPrev, fMempoolChangedPrev;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fTipChangedPrev = fTipChanged;
+            fMempoolChangedPrev = fMempoolChanged;
+            fTipChanged = fMempoolChanged = false;
+        }
+        // Store the pindexBest used before CreateNewBlock, to avoid races
+        CBlockIndex* pindexPrevNew = pindexBest;
+        unsigned int nTransactionsUpdatedNew = nTransactionsUpdated;
+        int64 nStart = GetTimeMicros();
+        CBlockTemplate* pblocktemplate = CreateNewBlock(*pMiningKey);
+        if (!pblocktemplate)
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fTipChanged |= fTipChangedPrev;
+            fMempoolChanged |= fMempoolChangedPrev;
+            return;
+        }
+        ptemplate.reset(pblocktemplate);
+        pindexPrev = pindexPrevNew;
+        nTransactionsUpdatedLast = nTransactionsUpdatedNew;
+        nBuilt = GetTime();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nNextRefresh = nBuilt + nRefreshSeconds;
+        }
+        if (fDebug)
+            printf("CBlockTemplateBuilder : built template on %s in %"PRI64d"us\n",
+                   pindexPrev->GetBlockHash().ToString().c_str(), GetTimeMicros() - nStart);
+    }
+
+    // Whether the tip changed, or the memory pool changed and the template
+    // is at least nMaxAge seconds old
+    // requires cs_main
+    bool IsStale(int64 nMaxAge) const
+    {
+        return pindexPrev != pindexBest ||
+               (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nBuilt >= nMaxAge);
+    }
+
+    // Whether a change was notified that calls for a build now, as far as
+    // the builder can tell without cs_main
+    bool IsDue()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fTipChanged || (fMempoolChanged && GetTime() >= nNextRefresh);
+    }
+
+public:
+    // How often a changed memory pool is built into a new template
+    static const int nRefreshSeconds = 5;
+
+    CBlockTemplateBuilder() : fNotified(false), fTipChanged(true), fMempoolChanged(false), nLastRequest(0), nNextRefresh(0),
+                              pindexPrev(NULL), nTransactionsUpdatedLast(0), nBuilt(0) {}
+
+    void Notify()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fTipChanged = true;
+        fNotified = true;
+        cond.notify_one();
+    }
+
+    // A transaction entered the memory pool: wake the builder only once the
+    // template is due for a refresh, so a burst does not wake it per
+    // transaction
+    void NotifyMempool()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fMempoolChanged = true;
+        if (GetTime() < nNextRefresh)
+            return;
+        fNotified = true;
+        cond.notify_one();
+    }
+
+    // The latest template. It is only built here if there is none on the
+    // current tip, or if the memory pool changed and the builder thread has
+    // fallen well behind; otherwise the thread keeps it fresh.
+    // Callers that change the template work on a copy.
+    // requires LOCK2(cs_main, pwalletMain->cs_wallet)
+    boost::shared_ptr<CBlockTemplate> Get(CBlockIndex*& pindexPrevRet, unsigned int& nTransactionsUpdatedRet)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nLastRequest = GetTime();
+        }
+        if (pindexPrev != pindexBest)
+            ptemplate.reset();
+        if (!ptemplate || IsStale(2 * nRefreshSeconds))
+            Build();
+        pindexPrevRet = pindexPrev;
+        nTransactionsUpdatedRet = nTransactionsUpdatedLast;
+        return ptemplate;
+    }
+
+    void Thread()
+    {
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (!fNotified)
+                    cond.timed_wait(lock, boost::get_system_time() + boost::posix_time::seconds(1));
+                fNotified = false;
+                if (GetTime() - nLastRequest > 10 * 60)
+                    continue;
+            }
+            {
+                LOCK(cs_vNodes);
+                if (vNodes.empty())
+                    continue;
+            }
+            if (IsInitialBlockDownload() || !IsDue())
+                continue;
+
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            if (IsStale(nRefreshSeconds))
+            {
+                try {
+                    Build();
+                } catch (std::exception& e) {
+                    PrintExceptionContinue(&e, "CBlockTemplateBuilder::Thread()");
+                }
+            }
+            else
+            {
+                // Already built by Get() since the change was notified
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fTipChanged = false;
+                if (nTransactionsUpdated == nTransactionsUpdatedLast)
+                    fMempoolChanged = false;
+            }
+        }
+    }
+};
+
+static CBlockTemplateBuilder templatebuilder;
+static boost::thread* pthreadTemplateBuilder = NULL;
+
+static void NotifyTemplateBuilder()
+{
+    templatebuilder.Notify();
+}
+
+static void NotifyTemplateBuilderMempool()
+{
+    templatebuilder.NotifyMempool();
+}
+
+static void ThreadBlockTemplateBuilder()
+{
+    templatebuilder.Thread();
+}
+
 void InitRPCMining()
 
 {
      pMiningKey = new CReserveKey(pwalletMain);
-	 
+
+     uiInterface.NotifyBlocksChanged.connect(&NotifyTemplateBuilder);
+     uiInterface.NotifyMempoolChanged.connect(&NotifyTemplateBuilderMempool);
+     pthreadTemplateBuilder = new boost::thread(boost::bind(&TraceThread<void (*)()>, "template", &ThreadBlockTemplateBuilder));
 }
 
 void ShutdownRPCMining()
 {
+     if (pthreadTemplateBuilder)
+     {
+         uiInterface.NotifyBlocksChanged.disconnect(&NotifyTemplateBuilder);
+         uiInterface.NotifyMempoolChanged.disconnect(&NotifyTemplateBuilderMempool);
+         pthreadTemplateBuilder->interrupt();
+         pthreadTemplateBuilder->join();
+         delete pthreadTemplateBuilder;
+         pthreadTemplateBuilder = NULL;
+     }
      delete pMiningKey; pMiningKey = NULL;
 }
 	 
@@ -194,15 +391,13 @@ Value getwork(const Array& params, bool fHelp)
             // Clear pindexPrev so future getworks make a new block, despite any failures from here on
             pindexPrev = NULL;
 
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlock(*pMiningKey);
-            if (!pblocktemplate)
+            // Take the prebuilt block; getwork changes its coinbase, so in a copy
+            CBlockIndex* pindexPrevNew;
+            boost::shared_ptr<CBlockTemplate> pbuilt = templatebuilder.Get(pindexPrevNew, nTransactionsUpdatedLast);
+            if (!pbuilt)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            nStart = GetTime();
+            pblocktemplate = new CBlockTemplate(*pbuilt);
             vNewBlockTemplate.push_back(pblocktemplate);
 
             // Need to update only after we know CreateNewBlock succeeded
@@ -219,7 +414,7 @@ Value getwork(const Array& params, bool fHelp)
         IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].GetVin()[0].scriptSig);
 
         // Pre-build hash buffers
         char pmidstate[32];
@@ -255,8 +450,8 @@ Value getwork(const Array& params, bool fHelp)
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->vtx[0].MutableVin()[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->hashMerkleRoot = pblock->UpdateMerkleTreeCoinbase();
 
         return CheckWork(pblock, *pwalletMain, *pMiningKey);
     }
@@ -304,15 +499,13 @@ Value getwork2(const Array& params, bool fHelp)
             // Clear pindexPrev so future getworks make a new block, despite any failures from here on
             pindexPrev = NULL;
 
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlock(*pMiningKey);
-            if (!pblocktemplate)
+            // Take the prebuilt block; getwork changes its coinbase, so in a copy
+            CBlockIndex* pindexPrevNew;
+            boost::shared_ptr<CBlockTemplate> pbuilt = templatebuilder.Get(pindexPrevNew, nTransactionsUpdatedLast);
+            if (!pbuilt)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            nStart = GetTime();
+            pblocktemplate = new CBlockTemplate(*pbuilt);
             vNewBlockTemplate.push_back(pblocktemplate);
 
             // Need to update only after we know CreateNewBlock succeeded
@@ -329,7 +522,7 @@ Value getwork2(const Array& params, bool fHelp)
         IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].GetVin()[0].scriptSig);
 
         // Pre-build hash buffers
         char pdata[128];
@@ -357,8 +550,8 @@ Value getwork2(const Array& params, bool fHelp)
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->vtx[0].MutableVin()[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->hashMerkleRoot = pblock->UpdateMerkleTreeCoinbase();
 
         return CheckWork(pblock, *pwalletMain, *pMiningKey);
     }
@@ -414,27 +607,19 @@ Value getblocktemplate(const Array& params, bool fHelp)
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
     static int64 nStart;
-    static CBlockTemplate* pblocktemplate;
+    static boost::shared_ptr<CBlockTemplate> pblocktemplate;
     if (pindexPrev != pindexBest ||
         (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        pblocktemplate = CreateNewBlock(*pMiningKey);
+        // Take the prebuilt block
+        CBlockIndex* pindexPrevNew;
+        pblocktemplate = templatebuilder.Get(pindexPrevNew, nTransactionsUpdatedLast);
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        nStart = GetTime();
 
         // Need to update only after we know CreateNewBlock succeeded
         pindexPrev = pindexPrevNew;
@@ -465,7 +650,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         entry.push_back(Pair("hash", txHash.GetHex()));
 
         Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
+        BOOST_FOREACH (const CTxIn &in, tx.GetVin())
         {
             if (setTxIndex.count(in.prevout.hash))
                 deps.push_back(setTxIndex[in.prevout.hash]);
@@ -497,7 +682,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].GetVout()[0].nValue));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
@@ -0,0 +1,32 @@
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "simd.h"
+
+#ifdef USE_SIMD
+#include <cpuid.h>
+
+unsigned int cpuid_edx = 0;
+#endif
+
+static SIMDLevel DetectSIMDLevel()
+{
+#ifdef USE_SIMD
+    unsigned int eax, ebx, ecx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &cpuid_edx))
+        cpuid_edx = 0;
+
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (cpuid_edx & (1 << 26))
+        return SIMD_SSE2;
+#endif
+    return SIMD_NONE;
+}
+
+SIMDLevel GetSIMDLevel()
+{
+    static const SIMDLevel level = DetectSIMDLevel();
+    return level;
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SIMD_H
+#define BITCOIN_SIMD_H
+
+#include "util.h"
+
+#if defined(_M_IX86) || defined(__i386__) || defined(__i386) || defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64)
+#define USE_SIMD 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+//
+// Helpers shared by the SIMD hash kernels (nonce scanning and merkle tree
+// levels): big endian word access, and picking the widest kernel the CPU
+// runs correctly. The vector primitives themselves are in simdlanes.h.
+//
+
+static inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+enum SIMDLevel
+{
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+/** The widest vector instruction set the CPU supports, detected once */
+SIMDLevel GetSIMDLevel();
+
+/** Pick the widest kernel the CPU supports that agrees with the scalar code
+ *  in fnSelfTest, so a broken compiler or CPU can never produce wrong hashes.
+ *  The choice is logged as "pszCaller : using <kernel> pszHash kernel". */
+template<typename Fn>
+Fn SelectSIMDKernel(const char* pszCaller, const char* pszHash, Fn fnScalar, Fn fnSSE2, Fn fnAVX2,
+                    bool (*fnSelfTest)(Fn))
+{
+    Fn fn = fnScalar;
+    const char* pszKernel = "scalar";
+    SIMDLevel level = GetSIMDLevel();
+    if (level >= SIMD_AVX2 && fnSelfTest(fnAVX2))
+    {
+        fn = fnAVX2;
+        pszKernel = "avx2";
+    }
+    else if (level >= SIMD_SSE2 && fnSelfTest(fnSSE2))
+    {
+        fn = fnSSE2;
+        pszKernel = "sse2";
+    }
+    printf("%s : using %s %s kernel\n", pszCaller, pszKernel, pszHash);
+    return fn;
+}
+
+#endif
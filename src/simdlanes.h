@@ -0,0 +1,46 @@
+// Copyright (c) 2013-2014 The Blakecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Vector primitives over 32-bit lanes for the SIMD hash kernels. There is
+// deliberately no include guard: include this before each kernel with
+// SIMD_LANES set to 4 (SSE2) or 8 (AVX2), and once more after the last one
+// with SIMD_LANES undefined, which only drops the definitions.
+//
+
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VROTR
+#undef VSHR
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+
+#if defined(SIMD_LANES) && SIMD_LANES == 4
+
+#define VADD(a, b)  _mm_add_epi32(a, b)
+#define VXOR(a, b)  _mm_xor_si128(a, b)
+#define VAND(a, b)  _mm_and_si128(a, b)
+#define VOR(a, b)   _mm_or_si128(a, b)
+#define VROTR(a, n) _mm_or_si128(_mm_srli_epi32(a, n), _mm_slli_epi32(a, 32 - (n)))
+#define VSHR(a, n)  _mm_srli_epi32(a, n)
+#define VSET1(x)    _mm_set1_epi32(x)
+#define VLOAD(p)    _mm_loadu_si128((const __m128i*)(p))
+#define VSTORE(p, a) _mm_storeu_si128((__m128i*)(p), a)
+
+#elif defined(SIMD_LANES) && SIMD_LANES == 8
+
+#define VADD(a, b)  _mm256_add_epi32(a, b)
+#define VXOR(a, b)  _mm256_xor_si256(a, b)
+#define VAND(a, b)  _mm256_and_si256(a, b)
+#define VOR(a, b)   _mm256_or_si256(a, b)
+#define VROTR(a, n) _mm256_or_si256(_mm256_srli_epi32(a, n), _mm256_slli_epi32(a, 32 - (n)))
+#define VSHR(a, n)  _mm256_srli_epi32(a, n)
+#define VSET1(x)    _mm256_set1_epi32(x)
+#define VLOAD(p)    _mm256_loadu_si256((const __m256i*)(p))
+#define VSTORE(p, a) _mm256_storeu_si256((__m256i*)(p), a)
+
+#endif
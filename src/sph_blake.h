@@ -122,6 +122,32 @@ void sph_blake256_close(void *cc, void *dst);
 void sph_blake256_addbits_and_close(
 	void *cc, unsigned ub, unsigned n, void *dst);
 
+/**
+ * Initialize a BLAKE-256 context and process exactly one 64-byte block
+ * of data, leaving the context as a midstate. The midstate is not
+ * modified by <code>sph_blake256_close_midstate()</code>, so it can be
+ * reused for many messages sharing the same first 64 bytes (e.g. block
+ * headers which only differ in their nonce or time).
+ *
+ * @param cc     the BLAKE-256 context
+ * @param data   the first 64 bytes of the message
+ */
+void sph_blake256_midstate(void *cc, const void *data);
+
+/**
+ * Process the remaining data bytes on top of a midstate produced by
+ * <code>sph_blake256_midstate()</code>, terminate the computation and
+ * output the result (32 bytes) into the provided buffer. The midstate
+ * itself is left untouched.
+ *
+ * @param cc     the BLAKE-256 midstate context
+ * @param data   the input data following the first 64 bytes
+ * @param len    the input data length (in bytes)
+ * @param dst    the destination buffer
+ */
+void sph_blake256_close_midstate(const void *cc,
+	const void *data, size_t len, void *dst);
+
 
 #ifdef __cplusplus
 }
@@ -41,7 +41,7 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -53,12 +53,22 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    unsigned int nChanged = 0, nSkipped = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoinsCacheEntry &entry = it->second;
+        if (!(entry.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // created and spent entirely in memory: the database never had it
+        if ((entry.flags & CCoinsCacheEntry::FRESH) && entry.coins.IsPruned()) {
+            nSkipped++;
+            continue;
+        }
+        BatchWriteCoins(batch, it->first, entry.coins);
+        nChanged++;
+    }
+    printf("Committing %u changed transactions (%u skipped, %u cached) to coin database...\n", nChanged, nSkipped, (unsigned int)mapCoins.size());
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
@@ -185,8 +195,186 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+/** Parses and checks block index records on worker threads while the
+ * caller keeps iterating the database. Records travel in batches of raw
+ * key/value strings; the parsed entries come back to the caller, which
+ * links them into mapBlockIndex on its own thread.
+ */
+class CBlockIndexLoader
+{
+public:
+    typedef std::vector<std::pair<std::string, std::string> > RawBatch;
+    typedef std::vector<std::pair<uint256, CDiskBlockIndex> > ParsedBatch;
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    std::deque<RawBatch> queueRaw;
+    std::deque<ParsedBatch> queueParsed;
+    // Batches handed out but not yet returned by Pop()
+    unsigned int nInFlight;
+    unsigned int nMaxInFlight;
+    bool fQuit;
+    std::string strError;
+    bool fCheckPoW;
+    boost::thread_group threadGroup;
+
+    void ThreadWorker()
+    {
+        RenameThread("blakecoin-loadidx");
+        while (true) {
+            RawBatch batch;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueRaw.empty() && !fQuit)
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                batch.swap(queueRaw.front());
+                queueRaw.pop_front();
+            }
+
+            ParsedBatch parsed;
+            std::string strBatchError;
+            parsed.reserve(batch.size());
+            BOOST_FOREACH(const PAIRTYPE(std::string, std::string)& record, batch) {
+                try {
+                    CDataStream ssKey(record.first.data(), record.first.data() + record.first.size(), SER_DISK, CLIENT_VERSION);
+                    char chType;
+                    uint256 hash;
+                    ssKey >> chType >> hash;
+                    CDataStream ssValue(record.second.data(), record.second.data() + record.second.size(), SER_DISK, CLIENT_VERSION);
+                    CDiskBlockIndex diskindex;
+                    ssValue >> diskindex;
+
+                    if (fCheckPoW && diskindex.GetBlockHash() != hash) {
+                        strBatchError = strprintf("block index key mismatch: %s", hash.ToString().c_str());
+                        break;
+                    }
+                    if (fCheckPoW && !CheckProofOfWork(hash, diskindex.nBits)) {
+                        strBatchError = strprintf("CheckIndex failed: %s", hash.ToString().c_str());
+                        break;
+                    }
+
+                    // Only records that passed every check get linked
+                    parsed.push_back(make_pair(hash, diskindex));
+                } catch (std::exception &e) {
+                    strBatchError = "deserialize error";
+                    break;
+                }
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!strBatchError.empty() && strError.empty())
+                strError = strBatchError;
+            queueParsed.push_back(ParsedBatch());
+            queueParsed.back().swap(parsed);
+            condMaster.notify_one();
+        }
+    }
+
+public:
+    CBlockIndexLoader(bool fCheckPoWIn) : nInFlight(0), fQuit(false), fCheckPoW(fCheckPoWIn)
+    {
+        int nThreads = boost::thread::hardware_concurrency();
+        if (nThreads < 1)
+            nThreads = 1;
+        if (nThreads > 8)
+            nThreads = 8;
+        nMaxInFlight = 4 * nThreads;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockIndexLoader::ThreadWorker, this));
+    }
+
+    ~CBlockIndexLoader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+    }
+
+    // Queue a batch of raw records; blocks while too many batches are in flight
+    void Push(RawBatch& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nInFlight >= nMaxInFlight && queueParsed.empty())
+            condMaster.wait(lock);
+        queueRaw.push_back(RawBatch());
+        queueRaw.back().swap(batch);
+        nInFlight++;
+        condWorker.notify_one();
+    }
+
+    // Take a parsed batch if one is ready (or wait for one if fWait and any
+    // are still in flight). Returns false when there is nothing to take.
+    bool Pop(ParsedBatch& parsed, bool fWait)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fWait && queueParsed.empty() && nInFlight > 0)
+            condMaster.wait(lock);
+        if (queueParsed.empty())
+            return false;
+        parsed.swap(queueParsed.front());
+        queueParsed.pop_front();
+        nInFlight--;
+        return true;
+    }
+
+    std::string GetError()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return strError;
+    }
+};
+
+// Link parsed records into mapBlockIndex; must run on a single thread
+void static LinkBlockIndexBatch(const CBlockIndexLoader::ParsedBatch& parsed)
+{
+    BOOST_FOREACH(const PAIRTYPE(uint256, CDiskBlockIndex)& item, parsed) {
+        const uint256& hash = item.first;
+        const CDiskBlockIndex& diskindex = item.second;
+
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(hash);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nDataPos       = diskindex.nDataPos;
+        pindexNew->nUndoPos       = diskindex.nUndoPos;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+        pindexNew->nStatus        = diskindex.nStatus;
+        pindexNew->nTx            = diskindex.nTx;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+    }
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
+    // The block hash is part of the record key; re-hashing every header and
+    // re-checking its proof-of-work only guards against a corrupted index
+    bool fCheckPoW = GetBoolArg("-checkblockindexpow", true);
+    int64 nStart = GetTimeMillis();
+    unsigned int nLoaded = 0;
+
+    // Records are parsed and checked in parallel by the loader's workers,
+    // this thread only iterates the database and links the results
+    static const unsigned int nBatchSize = 4096;
+    CBlockIndexLoader loader(fCheckPoW);
+    CBlockIndexLoader::RawBatch batch;
+    CBlockIndexLoader::ParsedBatch parsed;
+    batch.reserve(nBatchSize);
+
     leveldb::Iterator *pcursor = NewIterator();
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
@@ -196,48 +384,36 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != 'b')
+            break; // finished loading block index
+        leveldb::Slice slValue = pcursor->value();
+        batch.push_back(make_pair(slKey.ToString(), slValue.ToString()));
+        if (batch.size() >= nBatchSize) {
+            loader.Push(batch);
+            batch.reserve(nBatchSize);
+            while (loader.Pop(parsed, false)) {
+                LinkBlockIndexBatch(parsed);
+                nLoaded += parsed.size();
             }
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
+        pcursor->Next();
     }
     delete pcursor;
 
+    if (!batch.empty())
+        loader.Push(batch);
+    while (loader.Pop(parsed, true)) {
+        LinkBlockIndexBatch(parsed);
+        nLoaded += parsed.size();
+    }
+
+    std::string strError = loader.GetError();
+    if (!strError.empty())
+        return error("LoadBlockIndex() : %s", strError.c_str());
+
+    printf("LoadBlockIndexGuts(): loaded %u entries in %"PRI64d"ms%s\n", nLoaded, GetTimeMillis() - nStart,
+           fCheckPoW ? "" : " (proof-of-work not checked)");
+
     return true;
 }
@@ -85,6 +85,9 @@ public:
     /** Block chain changed. */
     boost::signals2::signal<void ()> NotifyBlocksChanged;
 
+    /** A transaction entered the memory pool. */
+    boost::signals2::signal<void ()> NotifyMempoolChanged;
+
     /** Number of network connections changed. */
     boost::signals2::signal<void (int newNumConnections)> NotifyNumConnectionsChanged;
 
@@ -221,7 +221,7 @@ public:
     }
     bool IsMine(const CTransaction& tx) const
     {
-        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        BOOST_FOREACH(const CTxOut& txout, tx.GetVout())
             if (IsMine(txout) && txout.nValue >= nMinimumInputValue)
                 return true;
         return false;
@@ -233,7 +233,7 @@ public:
     int64 GetDebit(const CTransaction& tx) const
     {
         int64 nDebit = 0;
-        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        BOOST_FOREACH(const CTxIn& txin, tx.GetVin())
         {
             nDebit += GetDebit(txin);
             if (!MoneyRange(nDebit))
@@ -244,7 +244,7 @@ public:
     int64 GetCredit(const CTransaction& tx) const
     {
         int64 nCredit = 0;
-        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        BOOST_FOREACH(const CTxOut& txout, tx.GetVout())
         {
             nCredit += GetCredit(txout);
             if (!MoneyRange(nCredit))
@@ -255,7 +255,7 @@ public:
     int64 GetChange(const CTransaction& tx) const
     {
         int64 nChange = 0;
-        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        BOOST_FOREACH(const CTxOut& txout, tx.GetVout())
         {
             nChange += GetChange(txout);
             if (!MoneyRange(nChange))
@@ -481,7 +481,7 @@ public:
                 BOOST_FOREACH(char c, pthis->mapValue["spent"])
                     pthis->vfSpent.push_back(c != '0');
             else
-                pthis->vfSpent.assign(vout.size(), fSpent);
+                pthis->vfSpent.assign(GetVout().size(), fSpent);
 
             ReadOrderPos(pthis->nOrderPos, pthis->mapValue);
 
@@ -532,9 +532,9 @@ public:
 
     void MarkSpent(unsigned int nOut)
     {
-        if (nOut >= vout.size())
+        if (nOut >= GetVout().size())
             throw std::runtime_error("CWalletTx::MarkSpent() : nOut out of range");
-        vfSpent.resize(vout.size());
+        vfSpent.resize(GetVout().size());
         if (!vfSpent[nOut])
         {
             vfSpent[nOut] = true;
@@ -544,7 +544,7 @@ public:
 
     bool IsSpent(unsigned int nOut) const
     {
-        if (nOut >= vout.size())
+        if (nOut >= GetVout().size())
             throw std::runtime_error("CWalletTx::IsSpent() : nOut out of range");
         if (nOut >= vfSpent.size())
             return false;
@@ -553,7 +553,7 @@ public:
 
     int64 GetDebit() const
     {
-        if (vin.empty())
+        if (GetVin().empty())
             return 0;
         if (fDebitCached)
             return nDebitCached;
@@ -600,11 +600,11 @@ public:
             return nAvailableCreditCached;
 
         int64 nCredit = 0;
-        for (unsigned int i = 0; i < vout.size(); i++)
+        for (unsigned int i = 0; i < GetVout().size(); i++)
         {
             if (!IsSpent(i))
             {
-                const CTxOut &txout = vout[i];
+                const CTxOut &txout = GetVout()[i];
                 nCredit += pwallet->GetCredit(txout);
                 if (!MoneyRange(nCredit))
                     throw std::runtime_error("CWalletTx::GetAvailableCredit() : value out of range");
@@ -670,7 +670,7 @@ public:
                     mapPrev[tx.GetHash()] = &tx;
             }
 
-            BOOST_FOREACH(const CTxIn& txin, ptx->vin)
+            BOOST_FOREACH(const CTxIn& txin, ptx->GetVin())
             {
                 if (!mapPrev.count(txin.prevout.hash))
                     return false;
@@ -707,7 +707,7 @@ public:
 
     std::string ToString() const
     {
-        return strprintf("COutput(%s, %d, %d) [%s]", tx->GetHash().ToString().c_str(), i, nDepth, FormatMoney(tx->vout[i].nValue).c_str());
+        return strprintf("COutput(%s, %d, %d) [%s]", tx->GetHash().ToString().c_str(), i, nDepth, FormatMoney(tx->GetVout()[i].nValue).c_str());
     }
 
     void print() const